@@ -0,0 +1,255 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CHECKSUM_X86
+#endif
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#include "checksum.h"
+
+namespace Checksum {
+  using CrcTables = std::array<std::array<uint32_t, 256>, 16>;
+
+  // slice-by-16 用の表。tables[0] は 1 バイトずつの普通の表で、tables[k] は k バイト先まで進めたもの。
+  constexpr CrcTables makeCrcTables() {
+    CrcTables tables{};
+    for(uint32_t i{0}; i < 256; ++i) {
+      uint32_t c{i};
+      for(int j{0}; j < 8; ++j) {
+        c = (c & 1) ? (UINT32_C(0xedb88320) ^ (c >> 1)) : (c >> 1);
+      }
+      tables[0][i] = c;
+    }
+    for(uint32_t i{0}; i < 256; ++i) {
+      for(size_t k{1}; k < 16; ++k) {
+        uint32_t const c = tables[k - 1][i];
+        tables[k][i] = tables[0][c & 0xff] ^ (c >> 8);
+      }
+    }
+    return tables;
+  }
+  CrcTables constexpr const crcTables = makeCrcTables();
+
+  uint32_t load32(Byte const* p) {
+    return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) | (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+  }
+
+  // crc は反転済みの途中の値。
+  uint32_t crcSlice16(uint32_t crc, Byte const* data, size_t size) {
+    auto const& t = crcTables;
+    for(; size >= 16; size -= 16, data += 16) {
+      uint32_t const a = load32(data) ^ crc;
+      uint32_t const b = load32(data + 4);
+      uint32_t const c = load32(data + 8);
+      uint32_t const d = load32(data + 12);
+      crc = t[15][a & 0xff] ^ t[14][(a >> 8) & 0xff] ^ t[13][(a >> 16) & 0xff] ^ t[12][a >> 24]
+          ^ t[11][b & 0xff] ^ t[10][(b >> 8) & 0xff] ^ t[9][(b >> 16) & 0xff] ^ t[8][b >> 24]
+          ^ t[7][c & 0xff] ^ t[6][(c >> 8) & 0xff] ^ t[5][(c >> 16) & 0xff] ^ t[4][c >> 24]
+          ^ t[3][d & 0xff] ^ t[2][(d >> 8) & 0xff] ^ t[1][(d >> 16) & 0xff] ^ t[0][d >> 24];
+    }
+    for(; size > 0; --size, ++data) {
+      crc = t[0][(crc ^ *data) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+  }
+
+#if defined(CHECKSUM_X86)
+  __attribute__((target("pclmul,sse4.1")))
+  __m128i fold(__m128i x, __m128i next, __m128i k) {
+    __m128i const lo = _mm_clmulepi64_si128(x, k, 0x00);
+    __m128i const hi = _mm_clmulepi64_si128(x, k, 0x11);
+    return _mm_xor_si128(_mm_xor_si128(hi, next), lo);
+  }
+
+  // Intel の "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction" による畳み込み。
+  // 64 バイト以上で 16 の倍数の長さだけを扱う。定数はビット反転した CRC-32 の多項式に対するもの。
+  __attribute__((target("pclmul,sse4.1")))
+  uint32_t crcFold(uint32_t crc, Byte const* data, size_t size) {
+    alignas(16) static uint64_t const k1k2[] = {0x0154442bd4, 0x01c6e41596};
+    alignas(16) static uint64_t const k3k4[] = {0x01751997d0, 0x00ccaa009e};
+    alignas(16) static uint64_t const k5k0[] = {0x0163cd6124, 0x0000000000};
+    alignas(16) static uint64_t const poly[] = {0x01db710641, 0x01f7011641};
+    auto load = [](Byte const* p) { return _mm_loadu_si128(reinterpret_cast<__m128i const*>(p)); };
+
+    __m128i x1 = load(data);
+    __m128i x2 = load(data + 16);
+    __m128i x3 = load(data + 32);
+    __m128i x4 = load(data + 48);
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    __m128i x0 = _mm_load_si128(reinterpret_cast<__m128i const*>(k1k2));
+    data += 64;
+    size -= 64;
+
+    // 64 バイトずつ 4 本並べて畳む。
+    for(; size >= 64; size -= 64, data += 64) {
+      __m128i const x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+      __m128i const x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+      __m128i const x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+      __m128i const x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+      x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+      x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+      x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+      x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+      x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), load(data));
+      x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), load(data + 16));
+      x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), load(data + 32));
+      x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), load(data + 48));
+    }
+
+    // 4 本を 128 bit 1 本に畳む。
+    x0 = _mm_load_si128(reinterpret_cast<__m128i const*>(k3k4));
+    x1 = fold(x1, x2, x0);
+    x1 = fold(x1, x3, x0);
+    x1 = fold(x1, x4, x0);
+    for(; size >= 16; size -= 16, data += 16) {
+      x1 = fold(x1, load(data), x0);
+    }
+
+    // 128 bit から 64 bit へ。
+    __m128i const mask = _mm_setr_epi32(~0, 0, ~0, 0);
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x0 = _mm_loadl_epi64(reinterpret_cast<__m128i const*>(k5k0));
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett 還元で 32 bit へ。
+    x0 = _mm_load_si128(reinterpret_cast<__m128i const*>(poly));
+    x2 = _mm_and_si128(x1, mask);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, mask);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return _mm_extract_epi32(x1, 1);
+  }
+
+  bool hasPclmul() {
+    static bool const has = (__builtin_cpu_init(), __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"));
+    return has;
+  }
+#endif
+
+#if defined(__ARM_FEATURE_CRC32)
+  uint32_t crcArm(uint32_t crc, Byte const* data, size_t size) {
+    for(; size >= 8; size -= 8, data += 8) {
+      uint64_t v;
+      std::memcpy(&v, data, 8);
+      crc = __crc32d(crc, v);
+    }
+    for(; size > 0; --size, ++data) {
+      crc = __crc32b(crc, *data);
+    }
+    return crc;
+  }
+#endif
+
+  uint32_t crc32(uint32_t crc, Byte const* data, size_t size) {
+    crc = ~crc;
+#if defined(__ARM_FEATURE_CRC32)
+    return ~crcArm(crc, data, size);
+#else
+#if defined(CHECKSUM_X86)
+    if(hasPclmul() && size >= 64) {
+      size_t const n = size & ~static_cast<size_t>(15);
+      crc = crcFold(crc, data, n);
+      data += n;
+      size -= n;
+    }
+#endif
+    return ~crcSlice16(crc, data, size);
+#endif
+  }
+
+  uint32_t const adlerBase{65521};
+  // s2 が 32 bit に収まる最大のバイト数。
+  size_t const adlerNmax{5552};
+
+  uint32_t adlerScalar(uint32_t adler, Byte const* data, size_t size) {
+    uint32_t s1 = adler & 0xffff;
+    uint32_t s2 = adler >> 16;
+    while(size > 0) {
+      size_t n = std::min(size, adlerNmax);
+      size -= n;
+      for(; n > 0; --n) {
+        s1 += *data++;
+        s2 += s1;
+      }
+      s1 %= adlerBase;
+      s2 %= adlerBase;
+    }
+    return s1 | (s2 << 16);
+  }
+
+#if defined(CHECKSUM_X86)
+  // 32 バイトずつ、s1 は _mm_sad_epu8 で、s2 は位置の重み(32..1)との積和で足し込む。
+  __attribute__((target("ssse3")))
+  uint32_t adlerSSSE3(uint32_t adler, Byte const* data, size_t size) {
+    uint32_t s1 = adler & 0xffff;
+    uint32_t s2 = adler >> 16;
+    size_t const block{32};
+    size_t blocks = size / block;
+    size -= blocks * block;
+
+    __m128i const tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+    __m128i const tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    __m128i const zero = _mm_setzero_si128();
+    __m128i const ones = _mm_set1_epi16(1);
+    while(blocks > 0) {
+      size_t n = std::min(blocks, adlerNmax / block);
+      blocks -= n;
+      // vps はそれまでのブロックの s1 の合計で、最後に 32 倍して s2 に足す。
+      __m128i vps = _mm_set_epi32(0, 0, 0, s1 * n);
+      __m128i vs2 = _mm_set_epi32(0, 0, 0, s2);
+      __m128i vs1 = zero;
+      for(; n > 0; --n, data += block) {
+        __m128i const b1 = _mm_loadu_si128(reinterpret_cast<__m128i const*>(data));
+        __m128i const b2 = _mm_loadu_si128(reinterpret_cast<__m128i const*>(data + 16));
+        vps = _mm_add_epi32(vps, vs1);
+        vs1 = _mm_add_epi32(vs1, _mm_sad_epu8(b1, zero));
+        vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_maddubs_epi16(b1, tap1), ones));
+        vs1 = _mm_add_epi32(vs1, _mm_sad_epu8(b2, zero));
+        vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_maddubs_epi16(b2, tap2), ones));
+      }
+      vs2 = _mm_add_epi32(vs2, _mm_slli_epi32(vps, 5));
+      vs1 = _mm_add_epi32(vs1, _mm_shuffle_epi32(vs1, _MM_SHUFFLE(1, 0, 3, 2)));
+      s1 += _mm_cvtsi128_si32(vs1);
+      vs2 = _mm_add_epi32(vs2, _mm_shuffle_epi32(vs2, _MM_SHUFFLE(2, 3, 0, 1)));
+      vs2 = _mm_add_epi32(vs2, _mm_shuffle_epi32(vs2, _MM_SHUFFLE(1, 0, 3, 2)));
+      s2 = _mm_cvtsi128_si32(vs2);
+      s1 %= adlerBase;
+      s2 %= adlerBase;
+    }
+    return adlerScalar(s1 | (s2 << 16), data, size);
+  }
+
+  bool hasSSSE3() {
+    static bool const has = (__builtin_cpu_init(), __builtin_cpu_supports("ssse3"));
+    return has;
+  }
+#endif
+
+  uint32_t adler32(uint32_t adler, Byte const* data, size_t size) {
+#if defined(CHECKSUM_X86)
+    if(hasSSSE3()) {
+      return adlerSSSE3(adler, data, size);
+    }
+#endif
+    return adlerScalar(adler, data, size);
+  }
+
+  uint32_t adler32Combine(uint32_t adler1, uint32_t adler2, size_t size2) {
+    // 後ろのデータの各バイトは s2 に (残りのバイト数 + 1) 回足されるので、前の s1 が size2 回余分に足される。
+    uint64_t const rem = size2 % adlerBase;
+    uint64_t const a1 = adler1 & 0xffff;
+    uint64_t const s1 = (a1 + (adler2 & 0xffff) + adlerBase - 1) % adlerBase;
+    uint64_t const s2 = (rem * a1 % adlerBase + (adler1 >> 16) + (adler2 >> 16) + adlerBase - rem) % adlerBase;
+    return s1 | (s2 << 16);
+  }
+}
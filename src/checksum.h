@@ -0,0 +1,17 @@
+#include <cstddef>
+#include <cstdint>
+
+#include "byte.h"
+
+#pragma once
+
+// zlib と同じく、前回の戻り値を渡せば続きから計算できる。
+// CPU が対応していれば CRC-32 は PCLMULQDQ か ARMv8 の CRC 命令、Adler-32 は SSSE3 を使う。
+namespace Checksum {
+  // 初期値は 0。
+  uint32_t crc32(uint32_t crc, Byte const* data, size_t size);
+  // 初期値は 1。
+  uint32_t adler32(uint32_t adler, Byte const* data, size_t size);
+  // adler1 の続きに、Adler-32 が adler2 で長さ size2 のデータをつなげた時の Adler-32。
+  uint32_t adler32Combine(uint32_t adler1, uint32_t adler2, size_t size2);
+}
@@ -0,0 +1,64 @@
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "image.h"
+
+#pragma once
+
+// 色を数えるための開番地法のハッシュ表。番号は入れた順で、256 色までしか入れない。
+class ColorTable {
+public:
+  ColorTable() {
+    keys_.fill(empty);
+  }
+  ColorTable(std::vector<Pixel> const& palette) : ColorTable{} {
+    for(Pixel const& p: palette) {
+      index(p);
+    }
+  }
+
+  // 色の番号を返す。無ければ加えるが、257 色目になる時は -1。
+  int index(Pixel p) {
+    uint32_t const key = (static_cast<uint32_t>(p.r) << 16) | (p.g << 8) | p.b;
+    for(size_t i{(key * 0x9e3779b1u) >> (32 - bits)};; i = (i + 1) & (size - 1)) {
+      if(keys_[i] == key) {
+        return values_[i];
+      }
+      if(keys_[i] == empty) {
+        if(colors_.size() == 256) {
+          return -1;
+        }
+        keys_[i] = key;
+        values_[i] = colors_.size();
+        colors_.push_back(p);
+        return values_[i];
+      }
+    }
+  }
+
+  // 加えずに探す。無ければ -1。
+  int find(Pixel p) const {
+    uint32_t const key = (static_cast<uint32_t>(p.r) << 16) | (p.g << 8) | p.b;
+    for(size_t i{(key * 0x9e3779b1u) >> (32 - bits)};; i = (i + 1) & (size - 1)) {
+      if(keys_[i] == key) {
+        return values_[i];
+      }
+      if(keys_[i] == empty) {
+        return -1;
+      }
+    }
+  }
+
+  std::vector<Pixel> const& colors() const { return colors_; }
+
+private:
+  // 256 色入っても 1/4 しか埋まらない大きさにして、探す距離を短くする。
+  inline static size_t const bits{10};
+  inline static size_t const size{1 << bits};
+  inline static uint32_t const empty{0xffffffff};
+  std::array<uint32_t, size> keys_;
+  std::array<Byte, size> values_;
+  std::vector<Pixel> colors_;
+};
@@ -1,35 +1,370 @@
 #include <algorithm>
+#include <array>
 #include <memory>
 
 #include "deflate.h"
+#include "checksum.h"
+#include "inflate.h"
+#include "parallel.h"
 
 #define MINIZ_NO_ZLIB_COMPATIBLE_NAMES
 #include "miniz.c"
 
 using std::begin;
+using std::end;
 
+// zlib の枠(ヘッダと Adler-32)はここで付け外しし、miniz には生の deflate 列だけを扱わせる。
+// 全てメモリにある列の伸長は Inflate で行い、miniz は圧縮と少しずつ読む伸長(Inflater)にだけ使う。
+// Adler-32 は Checksum のものを使う。
 namespace Deflate {
-  std::vector<Byte> compress(std::vector<Byte> const& src) {
-    unsigned long size = mz_compressBound(src.size());
-    std::unique_ptr<Byte> buf{new Byte[size]};
-    int status = mz_compress(buf.get(), &size, src.data(), src.size());
-    if (status != MZ_OK) {
+  bool validHeader(Byte cmf, Byte flg) {
+    // deflate で、プリセット辞書を使っていないこと。
+    return (cmf & 0x0f) == 8 && ((cmf << 8) | flg) % 31 == 0 && !(flg & 0x20);
+  }
+
+  void putAdler(Byte* p, uint32_t adler) {
+    p[0] = adler >> 24;
+    p[1] = adler >> 16;
+    p[2] = adler >> 8;
+    p[3] = adler;
+  }
+
+  uint32_t getAdler(Byte const* p) {
+    return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) | (static_cast<uint32_t>(p[2]) << 8) | p[3];
+  }
+
+  int compFlags(Level level) {
+    switch(level) {
+    case Level::Stored:
+      return tdefl_create_comp_flags_from_zip_params(MZ_NO_COMPRESSION, -MZ_DEFAULT_WINDOW_BITS, MZ_DEFAULT_STRATEGY);
+    case Level::RLE:
+      return tdefl_create_comp_flags_from_zip_params(MZ_BEST_SPEED, -MZ_DEFAULT_WINDOW_BITS, MZ_RLE);
+    case Level::Fast:
+      return tdefl_create_comp_flags_from_zip_params(MZ_BEST_SPEED, -MZ_DEFAULT_WINDOW_BITS, MZ_DEFAULT_STRATEGY);
+    case Level::Max:
+      return tdefl_create_comp_flags_from_zip_params(MZ_UBER_COMPRESSION, -MZ_DEFAULT_WINDOW_BITS, MZ_DEFAULT_STRATEGY);
+    default:
+      return tdefl_create_comp_flags_from_zip_params(MZ_DEFAULT_COMPRESSION, -MZ_DEFAULT_WINDOW_BITS, MZ_DEFAULT_STRATEGY);
+    }
+  }
+
+  // zlib ヘッダ。FLEVEL には圧縮レベルの目安を入れる(伸長には使われない)。
+  std::array<Byte, 2> header(Level level) {
+    switch(level) {
+    case Level::Stored:
+    case Level::RLE:
+    case Level::Fast:
+      return {0x78, 0x01};
+    case Level::Max:
+      return {0x78, 0xda};
+    default:
+      return {0x78, 0x9c};
+    }
+  }
+
+  std::vector<Byte> compress(std::vector<Byte> const& src, Level level) {
+    return compress(src.data(), src.size(), level);
+  }
+
+  std::vector<Byte> compress(Byte const* src, size_t srcSize, Level level) {
+    std::vector<Byte> v(mz_compressBound(srcSize) + 6);
+    std::array<Byte, 2> const h = header(level);
+    std::copy(begin(h), end(h), begin(v));
+    size_t const size = tdefl_compress_mem_to_mem(v.data() + 2, v.size() - 6, src, srcSize, compFlags(level));
+    if(size == 0 && srcSize != 0) {
       return {};
     }
-    std::vector<Byte> v(size);
-    std::copy_n(buf.get(), size, begin(v));
+    putAdler(v.data() + 2 + size, Checksum::adler32(1, src, srcSize));
+    v.resize(2 + size + 4);
     return v;
   }
 
-  std::vector<Byte> decompress(std::vector<Byte> const& src) {
-    unsigned long size = src.size() * 100; //
-    std::unique_ptr<Byte> buf{new Byte[size]};
-    int status = mz_uncompress(buf.get(), &size, src.data(), src.size());
-    if (status != MZ_OK) {
+  size_t const blockSize{128 * 1024};
+  size_t const dictSize{32 * 1024};
+
+  mz_bool append(void const* buf, int len, void* user) {
+    auto& v = *static_cast<std::vector<Byte>*>(user);
+    Byte const* p = static_cast<Byte const*>(buf);
+    v.insert(v.end(), p, p + len);
+    return MZ_TRUE;
+  }
+
+  // src を blockSize ごとの区間に分けて並列に圧縮し、1つの zlib 列につなぐ。
+  // independent でなければ直前の区間の末尾を辞書にして sync flush でつなぎ、そうなら辞書を使わず full flush で区切る。
+  // offsets には2つ目以降の区間が始まる、列の先頭からの位置を入れる。
+  std::vector<Byte> compressBlocks(std::vector<Byte> const& src, Level level, size_t blockSize, bool independent, std::vector<size_t>& offsets) {
+    offsets.clear();
+    size_t const count = (src.size() + blockSize - 1) / blockSize;
+    if(count <= 1) {
+      return compress(src, level);
+    }
+    std::vector<std::vector<Byte>> blocks(count);
+    std::vector<uint32_t> adlers(count);
+    std::vector<char> ok(count);
+    int const flags = compFlags(level);
+    parallelFor(count, [&](size_t i) {
+      size_t const begin = i * blockSize;
+      size_t const size = std::min(blockSize, src.size() - begin);
+      bool const last = i + 1 == count;
+      auto comp = std::make_unique<tdefl_compressor>();
+      std::vector<Byte>& out = blocks[i];
+      tdefl_init(comp.get(), append, &out, flags);
+      bool good{true};
+      if(i != 0 && !independent) {
+        // 直前の区間の末尾を一度圧縮して窓に入れ、その出力は捨てる。
+        size_t const dict = std::min(dictSize, begin);
+        good = tdefl_compress_buffer(comp.get(), src.data() + begin - dict, dict, TDEFL_SYNC_FLUSH) == TDEFL_STATUS_OKAY;
+        out.clear();
+      }
+      // 途中の区間はバイト境界に揃えて終え、最終ブロックにはしない。
+      tdefl_flush const flush = last ? TDEFL_FINISH : independent ? TDEFL_FULL_FLUSH : TDEFL_SYNC_FLUSH;
+      tdefl_status const status = tdefl_compress_buffer(comp.get(), src.data() + begin, size, flush);
+      ok[i] = good && status == (last ? TDEFL_STATUS_DONE : TDEFL_STATUS_OKAY);
+      adlers[i] = Checksum::adler32(1, src.data() + begin, size);
+    });
+    if(std::find(ok.begin(), ok.end(), false) != ok.end()) {
       return {};
     }
-    std::vector<Byte> v(size);
-    std::copy_n(buf.get(), size, begin(v));
+
+    size_t total{6};
+    for(auto const& b: blocks) {
+      total += b.size();
+    }
+    std::vector<Byte> v;
+    v.reserve(total);
+    std::array<Byte, 2> const h = header(level);
+    v.insert(v.end(), begin(h), end(h));
+    uint32_t adler{adlers[0]};
+    for(size_t i{0}; i < count; ++i) {
+      if(i != 0) {
+        offsets.push_back(v.size());
+        adler = Checksum::adler32Combine(adler, adlers[i], std::min(blockSize, src.size() - i * blockSize));
+      }
+      v.insert(v.end(), blocks[i].begin(), blocks[i].end());
+    }
+    v.resize(total);
+    putAdler(v.data() + total - 4, adler);
     return v;
   }
+
+  std::vector<Byte> compressParallel(std::vector<Byte> const& src, Level level) {
+    std::vector<size_t> offsets;
+    return compressBlocks(src, level, blockSize, false, offsets);
+  }
+
+  std::vector<Byte> compressIndependent(std::vector<Byte> const& src, size_t blockSize, Level level, std::vector<size_t>& offsets) {
+    return compressBlocks(src, level, std::max<size_t>(blockSize, 1), true, offsets);
+  }
+
+  std::vector<Byte> decompress(std::vector<Byte> const& src) {
+    if(src.size() < 6 || !validHeader(src[0], src[1])) {
+      return {};
+    }
+    // 伸長後のサイズが分からないので、足りなくなったら倍々に伸ばして最初から伸長し直す。
+    std::vector<Byte> v(src.size() * 4 + 64);
+    while(true) {
+      Inflate::Result const r = Inflate::inflate(src.data() + 2, src.size() - 2, v.data(), v.size());
+      if(r.full) {
+        v.resize(v.size() * 2);
+        continue;
+      }
+      if(!r.ok || !r.final || 2 + r.in + 4 > src.size()) {
+        return {};
+      }
+      v.resize(r.out);
+      if(getAdler(src.data() + 2 + r.in) != Checksum::adler32(1, v.data(), v.size())) {
+        return {};
+      }
+      return v;
+    }
+  }
+
+  bool decompress(Byte const* src, size_t srcSize, Byte* dst, size_t dstSize) {
+    if(srcSize < 6 || !validHeader(src[0], src[1])) {
+      return false;
+    }
+    Inflate::Result const r = Inflate::inflate(src + 2, srcSize - 2, dst, dstSize);
+    // 最終ブロックの後ろのバイト境界から Adler-32 が続く。
+    if(!r.ok || !r.final || r.out != dstSize || 2 + r.in + 4 > srcSize) {
+      return false;
+    }
+    return getAdler(src + 2 + r.in) == Checksum::adler32(1, dst, dstSize);
+  }
+
+  bool decompressRaw(Byte const* src, size_t srcSize, Byte* dst, size_t dstSize, bool last) {
+    // 途中の断片は最終ブロックで終わらず、ブロックの切れ目で入力が尽きれば成功。
+    Inflate::Result const r = Inflate::inflate(src, srcSize, dst, dstSize);
+    return r.ok && r.out == dstSize && r.final == last;
+  }
+
+  // miniz の tinfl を直に使う。mz_inflate と同じく 32KiB の窓に伸長してから dst へ写すが、
+  // 伸長器と窓と入力の残りはここで持つので、deflate 列が終わった後のビットバッファも自分のものとして読める。
+  struct Inflater::State {
+    tinfl_decompressor decomp;
+    tinfl_status status;
+    // 伸長した分のうち、まだ dst へ写していないものは window[windowOfs] から windowAvail バイト。
+    std::array<Byte, TINFL_LZ_DICT_SIZE> window;
+    size_t windowOfs;
+    size_t windowAvail;
+    Byte const* in;
+    size_t inSize;
+    // まだ読んでいない zlib ヘッダのバイト数。
+    size_t headerLeft;
+    std::array<Byte, 2> header;
+    // 伸長した分の Adler-32。deflate 列が終わったら、続く 4 バイトと比べる。
+    uint32_t adler;
+    std::array<Byte, 4> trailer;
+    size_t trailerGot;
+
+    // 最終ブロックの終わりの後ろは、伸長器が先読みしてビットバッファに残した分、入力の残りの順に続く。
+    // 最終ブロックの残りのビットを捨てるとバイト境界になる。
+    void takeBitBuffer() {
+      tinfl_bit_buf_t bits = decomp.m_bit_buf >> (decomp.m_num_bits % 8);
+      for(size_t left{decomp.m_num_bits / 8}; left > 0 && trailerGot < trailer.size(); --left, bits >>= 8) {
+        trailer[trailerGot++] = bits & 0xff;
+      }
+      decomp.m_num_bits = 0;
+    }
+
+    // 入力の残りから Adler-32 を読み、揃ったら比べる。feed をまたいで少しずつ揃うこともある。
+    // 揃わないうちは finished も failed も返さない。
+    void readTrailer(bool& finished, bool& failed) {
+      for(; trailerGot < trailer.size() && inSize > 0; --inSize) {
+        trailer[trailerGot++] = *in++;
+      }
+      if(trailerGot == trailer.size()) {
+        finished = getAdler(trailer.data()) == adler;
+        failed = !finished;
+      }
+    }
+  };
+
+  // 伸長した分の Adler-32 は Checksum で計算し、deflate 列の後ろの値と合わなければ失敗にする。
+  // PNG の CRC はチャンクの壊れを見るだけで、読む側は食い違いを警告するだけなので、伸長結果はここで確かめる。
+  Inflater::Inflater() : state{std::make_unique<State>()}, finished_{false}, failed_{false} {
+    tinfl_init(&state->decomp);
+    state->status = TINFL_STATUS_NEEDS_MORE_INPUT;
+    state->windowOfs = 0;
+    state->windowAvail = 0;
+    state->in = nullptr;
+    state->inSize = 0;
+    state->headerLeft = 2;
+    state->adler = 1;
+    state->trailerGot = 0;
+  }
+
+  Inflater::~Inflater() = default;
+
+  void Inflater::feed(Byte const* src, size_t size) {
+    for(; state->headerLeft > 0 && size > 0; --state->headerLeft, --size) {
+      state->header[2 - state->headerLeft] = *src++;
+      if(state->headerLeft == 1 && !validHeader(state->header[0], state->header[1])) {
+        failed_ = true;
+      }
+    }
+    state->in = src;
+    state->inSize = size;
+  }
+
+  bool Inflater::needsInput() const {
+    return state->inSize == 0;
+  }
+
+  size_t Inflater::inflate(Byte* dst, size_t size) {
+    if(finished_ || failed_) {
+      return 0;
+    }
+    State& s = *state;
+    size_t written{0};
+    while(written < size) {
+      if(s.windowAvail > 0) {
+        size_t const n = std::min(s.windowAvail, size - written);
+        std::copy_n(s.window.data() + s.windowOfs, n, dst + written);
+        s.windowOfs = (s.windowOfs + n) & (TINFL_LZ_DICT_SIZE - 1);
+        s.windowAvail -= n;
+        written += n;
+        continue;
+      }
+      if(s.status == TINFL_STATUS_DONE) {
+        break;
+      }
+      size_t inBytes = s.inSize;
+      size_t outBytes = TINFL_LZ_DICT_SIZE - s.windowOfs;
+      s.status = tinfl_decompress(&s.decomp, s.in, &inBytes, s.window.data(), s.window.data() + s.windowOfs, &outBytes, TINFL_FLAG_HAS_MORE_INPUT);
+      s.in += inBytes;
+      s.inSize -= inBytes;
+      s.windowAvail = outBytes;
+      if(s.status < 0) {
+        failed_ = true;
+        break;
+      }
+      if(s.status == TINFL_STATUS_DONE) {
+        s.takeBitBuffer();
+      } else if(outBytes == 0 && s.status == TINFL_STATUS_NEEDS_MORE_INPUT) {
+        break;
+      }
+    }
+    s.adler = Checksum::adler32(s.adler, dst, written);
+    if(s.status == TINFL_STATUS_DONE && s.windowAvail == 0 && !failed_) {
+      s.readTrailer(finished_, failed_);
+    }
+    return written;
+  }
+
+  struct Deflater::State {
+    tdefl_compressor comp;
+    Output out;
+    uint32_t adler;
+  };
+
+  Deflater::Deflater(Output out, Level level) : state{std::make_unique<State>()} {
+    state->out = std::move(out);
+    state->adler = 1;
+    auto put = [](void const* buf, int len, void* user) -> mz_bool {
+      static_cast<State*>(user)->out(static_cast<Byte const*>(buf), len);
+      return MZ_TRUE;
+    };
+    tdefl_init(&state->comp, put, state.get(), compFlags(level));
+    std::array<Byte, 2> const h = header(level);
+    state->out(h.data(), h.size());
+  }
+
+  Deflater::~Deflater() = default;
+
+  bool Deflater::write(Byte const* src, size_t size) {
+    state->adler = Checksum::adler32(state->adler, src, size);
+    return tdefl_compress_buffer(&state->comp, src, size, TDEFL_NO_FLUSH) == TDEFL_STATUS_OKAY;
+  }
+
+  bool Deflater::finish() {
+    if(tdefl_compress_buffer(&state->comp, nullptr, 0, TDEFL_FINISH) != TDEFL_STATUS_DONE) {
+      return false;
+    }
+    std::array<Byte, 4> trailer;
+    putAdler(trailer.data(), state->adler);
+    state->out(trailer.data(), trailer.size());
+    return true;
+  }
+
+  struct Estimator::State {
+    tdefl_compressor comp;
+    size_t written;
+  };
+
+  Estimator::Estimator() : state{std::make_unique<State>()} {}
+
+  Estimator::~Estimator() = default;
+
+  size_t Estimator::size(Byte const* src, size_t size) {
+    state->written = 0;
+    auto count = [](void const*, int len, void* user) -> mz_bool {
+      static_cast<State*>(user)->written += len;
+      return MZ_TRUE;
+    };
+    // 行ごとに何度も呼ばれるので、探索を浅くして速さを優先する。
+    int const flags = tdefl_create_comp_flags_from_zip_params(1, -MZ_DEFAULT_WINDOW_BITS, MZ_DEFAULT_STRATEGY);
+    tdefl_init(&state->comp, count, state.get(), flags);
+    tdefl_compress_buffer(&state->comp, src, size, TDEFL_FINISH);
+    return state->written;
+  }
 }
@@ -1,10 +1,73 @@
 #include <vector>
+#include <memory>
+#include <functional>
 
 #include "byte.h"
 
 #pragma once
 
 namespace Deflate {
-  std::vector<Byte> compress(std::vector<Byte> const& src);
+  // 圧縮の速さと小ささの兼ね合い。Stored は圧縮せずにそのまま格納し、
+  // RLE は直前のバイトの繰り返しだけを探して後はハフマン符号にまかせる。
+  enum class Level { Stored, RLE, Fast, Default, Max };
+
+  std::vector<Byte> compress(std::vector<Byte> const& src, Level level = Level::Default);
+  std::vector<Byte> compress(Byte const* src, size_t size, Level level = Level::Default);
+  // 入力を固定長の区間に分けて区間ごとに別のスレッドで圧縮し、sync flush でつないで1つの zlib 列にする(pigz と同じ方式)。
+  // 各区間は直前の 32KiB を辞書にするので圧縮率はほとんど落ちない。区間の長さは固定なので、出力はスレッド数によらない。
+  std::vector<Byte> compressParallel(std::vector<Byte> const& src, Level level = Level::Default);
+  // blockSize バイトごとの区間を辞書を引き継がずに並列に圧縮し、full flush で区切って1つの zlib 列にする。
+  // 各区間は decompressRaw で別々に伸長できる。offsets には2つ目以降の区間が始まる位置(zlib ヘッダを含む列の先頭から)を返す。
+  std::vector<Byte> compressIndependent(std::vector<Byte> const& src, size_t blockSize, Level level, std::vector<size_t>& offsets);
   std::vector<Byte> decompress(std::vector<Byte> const& src);
+  // 伸長後のサイズが分かっている時はこちらを使う。
+  // dst に確保済みの領域へ直接書き込み、ちょうど dstSize バイトになった時だけ true を返す。
+  bool decompress(Byte const* src, size_t srcSize, Byte* dst, size_t dstSize);
+  // zlib ヘッダの無い生の deflate 列を伸長する。last でなければ、full flush で区切られた途中の断片として扱う。
+  bool decompressRaw(Byte const* src, size_t srcSize, Byte* dst, size_t dstSize, bool last);
+
+  // 入力を少しずつ与えながら伸長する。feed した領域は使い切るまで保持しておくこと。
+  // finished になるのは deflate 列の後ろの Adler-32 まで読んで合っていた時で、合わなければ failed になる。
+  class Inflater {
+  public:
+    Inflater();
+    ~Inflater();
+    void feed(Byte const* src, size_t size);
+    // 最大 size バイトを dst に書き出し、書いたバイト数を返す。
+    size_t inflate(Byte* dst, size_t size);
+    bool needsInput() const;
+    bool finished() const { return finished_; }
+    bool failed() const { return failed_; }
+  private:
+    struct State;
+    std::unique_ptr<State> state;
+    bool finished_;
+    bool failed_;
+  };
+
+  // 入力を少しずつ与えながら圧縮し、出来た分から順に out に渡す。zlib のヘッダと Adler-32 もここで付ける。
+  class Deflater {
+  public:
+    using Output = std::function<void(Byte const* data, size_t size)>;
+    Deflater(Output out, Level level = Level::Default);
+    ~Deflater();
+    bool write(Byte const* src, size_t size);
+    // 残りを全て出して、最後に Adler-32 を出す。
+    bool finish();
+  private:
+    struct State;
+    std::unique_ptr<State> state;
+  };
+
+  // 試しに圧縮して、圧縮後のバイト数を返す。出力は捨てる。
+  // 作業領域が大きいので、1つを使い回して何度も呼ぶ。
+  class Estimator {
+  public:
+    Estimator();
+    ~Estimator();
+    size_t size(Byte const* src, size_t size);
+  private:
+    struct State;
+    std::unique_ptr<State> state;
+  };
 }
@@ -0,0 +1,367 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FILTER_HAS_AVX2_TARGET
+#endif
+
+#include "filter.h"
+
+namespace Filter {
+  Byte paeth(Byte a, Byte b, Byte c) {
+    int p = static_cast<int>(a) + b - c;
+    int pa = std::abs(p - a);
+    int pb = std::abs(p - b);
+    int pc = std::abs(p - c);
+    if(pa <= pb && pa <= pc) {
+      return a;
+    } else if(pb <= pc) {
+      return b;
+    }
+    return c;
+  }
+
+  void none(Byte*, Byte const*, size_t) {}
+
+  template<size_t Bpp>
+  void sub(Byte* row, Byte const*, size_t size) {
+    for(size_t i{Bpp}; i < size; ++i) {
+      row[i] += row[i - Bpp];
+    }
+  }
+
+  void up(Byte* row, Byte const* prev, size_t size) {
+    for(size_t i{0}; i < size; ++i) {
+      row[i] += prev[i];
+    }
+  }
+
+  template<size_t Bpp>
+  void average(Byte* row, Byte const* prev, size_t size) {
+    for(size_t i{0}; i < Bpp && i < size; ++i) {
+      row[i] += prev[i] / 2;
+    }
+    for(size_t i{Bpp}; i < size; ++i) {
+      row[i] += (static_cast<int>(row[i - Bpp]) + prev[i]) / 2;
+    }
+  }
+
+  template<size_t Bpp>
+  void paeth(Byte* row, Byte const* prev, size_t size) {
+    for(size_t i{0}; i < Bpp && i < size; ++i) {
+      row[i] += prev[i];
+    }
+    for(size_t i{Bpp}; i < size; ++i) {
+      row[i] += paeth(row[i - Bpp], prev[i], prev[i - Bpp]);
+    }
+  }
+
+#if defined(__SSE2__)
+  // Sub/Ave/Paeth は左隣の画素に依存するので、1画素(3か4バイト)ずつを1レジスタで処理する。
+  // 3バイトの時も4バイト読むが、残りが4バイト以上ある間だけなのではみ出さない。
+  __m128i load4(void const* p) {
+    int v;
+    std::memcpy(&v, p, 4);
+    return _mm_cvtsi32_si128(v);
+  }
+  __m128i load3(void const* p) {
+    int v{0};
+    std::memcpy(&v, p, 3);
+    return _mm_cvtsi32_si128(v);
+  }
+  void store4(void* p, __m128i x) {
+    int v = _mm_cvtsi128_si32(x);
+    std::memcpy(p, &v, 4);
+  }
+  void store3(void* p, __m128i x) {
+    int v = _mm_cvtsi128_si32(x);
+    std::memcpy(p, &v, 3);
+  }
+
+  template<size_t Bpp>
+  __m128i loadPixel(void const* p, size_t rest) {
+    return (Bpp == 4 || rest >= 4) ? load4(p) : load3(p);
+  }
+  template<size_t Bpp>
+  void storePixel(void* p, __m128i x) {
+    if constexpr(Bpp == 4) {
+      store4(p, x);
+    } else {
+      store3(p, x);
+    }
+  }
+
+  template<size_t Bpp>
+  void subSSE2(Byte* row, Byte const*, size_t size) {
+    __m128i d = _mm_setzero_si128();
+    for(size_t rest{size}; rest >= Bpp; rest -= Bpp, row += Bpp) {
+      d = _mm_add_epi8(loadPixel<Bpp>(row, rest), d);
+      storePixel<Bpp>(row, d);
+    }
+  }
+
+  template<size_t Bpp>
+  void averageSSE2(Byte* row, Byte const* prev, size_t size) {
+    __m128i const one = _mm_set1_epi8(1);
+    __m128i d = _mm_setzero_si128();
+    for(size_t rest{size}; rest >= Bpp; rest -= Bpp, row += Bpp, prev += Bpp) {
+      __m128i const a = d;
+      __m128i const b = loadPixel<Bpp>(prev, rest);
+      // _mm_avg_epu8 は切り上げなので、切り上げた分を引いて切り捨てにする。
+      __m128i avg = _mm_avg_epu8(a, b);
+      avg = _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a, b), one));
+      d = _mm_add_epi8(loadPixel<Bpp>(row, rest), avg);
+      storePixel<Bpp>(row, d);
+    }
+  }
+
+  __m128i abs16(__m128i x) {
+    return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+  }
+  __m128i select(__m128i cond, __m128i t, __m128i e) {
+    return _mm_or_si128(_mm_and_si128(cond, t), _mm_andnot_si128(cond, e));
+  }
+
+  template<size_t Bpp>
+  void paethSSE2(Byte* row, Byte const* prev, size_t size) {
+    __m128i const zero = _mm_setzero_si128();
+    // 16bit に広げて計算する。a: 左, b: 上, c: 左上。
+    __m128i b = zero, d = zero;
+    for(size_t rest{size}; rest >= Bpp; rest -= Bpp, row += Bpp, prev += Bpp) {
+      __m128i const c = b;
+      __m128i const a = d;
+      b = _mm_unpacklo_epi8(loadPixel<Bpp>(prev, rest), zero);
+      d = _mm_unpacklo_epi8(loadPixel<Bpp>(row, rest), zero);
+      // p = a + b - c なので p - a = b - c, p - b = a - c, p - c = (b - c) + (a - c)。
+      __m128i pa = _mm_sub_epi16(b, c);
+      __m128i pb = _mm_sub_epi16(a, c);
+      __m128i pc = _mm_add_epi16(pa, pb);
+      pa = abs16(pa);
+      pb = abs16(pb);
+      pc = abs16(pc);
+      __m128i const smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+      __m128i const nearest = select(_mm_cmpeq_epi16(smallest, pa), a, select(_mm_cmpeq_epi16(smallest, pb), b, c));
+      // 上位バイトは 0 のままなので 8bit 加算で 256 の剰余になる。
+      d = _mm_add_epi8(d, nearest);
+      storePixel<Bpp>(row, _mm_packus_epi16(d, d));
+    }
+  }
+
+  void upSSE2(Byte* row, Byte const* prev, size_t size) {
+    size_t i{0};
+    for(; i + 16 <= size; i += 16) {
+      __m128i const r = _mm_loadu_si128(reinterpret_cast<__m128i const*>(row + i));
+      __m128i const p = _mm_loadu_si128(reinterpret_cast<__m128i const*>(prev + i));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(row + i), _mm_add_epi8(r, p));
+    }
+    up(row + i, prev + i, size - i);
+  }
+#endif
+
+#if defined(FILTER_HAS_AVX2_TARGET)
+  __attribute__((target("avx2")))
+  void upAVX2(Byte* row, Byte const* prev, size_t size) {
+    size_t i{0};
+    for(; i + 32 <= size; i += 32) {
+      __m256i const r = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(row + i));
+      __m256i const p = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(prev + i));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(row + i), _mm256_add_epi8(r, p));
+    }
+    up(row + i, prev + i, size - i);
+  }
+#endif
+
+  RowFunc upKernel() {
+#if defined(FILTER_HAS_AVX2_TARGET)
+    if(__builtin_cpu_supports("avx2")) {
+      return upAVX2;
+    }
+#endif
+#if defined(__SSE2__)
+    return upSSE2;
+#else
+    return up;
+#endif
+  }
+
+  template<size_t Bpp>
+  std::array<RowFunc, 5> scalarUnfilters() {
+    return {none, sub<Bpp>, upKernel(), average<Bpp>, paeth<Bpp>};
+  }
+
+  std::array<RowFunc, 5> unfilters(size_t bpp) {
+    switch(bpp) {
+    case 1: return scalarUnfilters<1>();
+    case 2: return scalarUnfilters<2>();
+#if defined(__SSE2__)
+    case 3: return {none, subSSE2<3>, upKernel(), averageSSE2<3>, paethSSE2<3>};
+    case 4: return {none, subSSE2<4>, upKernel(), averageSSE2<4>, paethSSE2<4>};
+#else
+    case 3: return scalarUnfilters<3>();
+    case 4: return scalarUnfilters<4>();
+#endif
+    case 6: return scalarUnfilters<6>();
+    default: return scalarUnfilters<8>();
+    }
+  }
+
+  // ここからエンコード側。フィルタ前の行だけを参照するので、左隣への依存が無く、行全体をまとめてベクトル化できる。
+  void noneFilter(Byte* out, Byte const* row, Byte const*, size_t size) {
+    std::memcpy(out, row, size);
+  }
+
+  template<size_t Bpp>
+  void subFilter(Byte* out, Byte const* row, Byte const*, size_t size, size_t from = 0) {
+    for(size_t i{from}; i < size; ++i) {
+      out[i] = row[i] - (i < Bpp ? 0 : row[i - Bpp]);
+    }
+  }
+
+  void upFilter(Byte* out, Byte const* row, Byte const* prev, size_t size, size_t from = 0) {
+    for(size_t i{from}; i < size; ++i) {
+      out[i] = row[i] - prev[i];
+    }
+  }
+
+  template<size_t Bpp>
+  void averageFilter(Byte* out, Byte const* row, Byte const* prev, size_t size, size_t from = 0) {
+    for(size_t i{from}; i < size; ++i) {
+      int const a = i < Bpp ? 0 : row[i - Bpp];
+      out[i] = row[i] - (a + prev[i]) / 2;
+    }
+  }
+
+  template<size_t Bpp>
+  void paethFilter(Byte* out, Byte const* row, Byte const* prev, size_t size, size_t from = 0) {
+    for(size_t i{from}; i < size; ++i) {
+      out[i] = row[i] - (i < Bpp ? prev[i] : paeth(row[i - Bpp], prev[i], prev[i - Bpp]));
+    }
+  }
+
+  size_t sumAbsScalar(Byte const* row, size_t size) {
+    size_t sum{0};
+    for(size_t i{0}; i < size; ++i) {
+      sum += row[i] < 128 ? row[i] : 256 - row[i];
+    }
+    return sum;
+  }
+
+#if defined(__SSE2__)
+  // 先頭の1画素は左隣が無いのでスカラーで処理し、残りを 16 バイト(Paeth は 8 バイト)ずつ処理する。
+  __m128i loadu(Byte const* p) {
+    return _mm_loadu_si128(reinterpret_cast<__m128i const*>(p));
+  }
+  void storeu(Byte* p, __m128i x) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(p), x);
+  }
+
+  template<size_t Bpp>
+  void subFilterSSE2(Byte* out, Byte const* row, Byte const* prev, size_t size) {
+    size_t i{std::min(Bpp, size)};
+    subFilter<Bpp>(out, row, prev, i);
+    for(; i + 16 <= size; i += 16) {
+      storeu(out + i, _mm_sub_epi8(loadu(row + i), loadu(row + i - Bpp)));
+    }
+    subFilter<Bpp>(out, row, prev, size, i);
+  }
+
+  void upFilterSSE2(Byte* out, Byte const* row, Byte const* prev, size_t size) {
+    size_t i{0};
+    for(; i + 16 <= size; i += 16) {
+      storeu(out + i, _mm_sub_epi8(loadu(row + i), loadu(prev + i)));
+    }
+    upFilter(out, row, prev, size, i);
+  }
+
+  template<size_t Bpp>
+  void averageFilterSSE2(Byte* out, Byte const* row, Byte const* prev, size_t size) {
+    __m128i const one = _mm_set1_epi8(1);
+    size_t i{std::min(Bpp, size)};
+    averageFilter<Bpp>(out, row, prev, i);
+    for(; i + 16 <= size; i += 16) {
+      __m128i const a = loadu(row + i - Bpp);
+      __m128i const b = loadu(prev + i);
+      __m128i const avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+      storeu(out + i, _mm_sub_epi8(loadu(row + i), avg));
+    }
+    averageFilter<Bpp>(out, row, prev, size, i);
+  }
+
+  template<size_t Bpp>
+  void paethFilterSSE2(Byte* out, Byte const* row, Byte const* prev, size_t size) {
+    __m128i const zero = _mm_setzero_si128();
+    auto load8 = [&](Byte const* p) { return _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<__m128i const*>(p)), zero); };
+    size_t i{std::min(Bpp, size)};
+    paethFilter<Bpp>(out, row, prev, i);
+    for(; i + 8 <= size; i += 8) {
+      __m128i const a = load8(row + i - Bpp);
+      __m128i const b = load8(prev + i);
+      __m128i const c = load8(prev + i - Bpp);
+      __m128i pa = _mm_sub_epi16(b, c);
+      __m128i pb = _mm_sub_epi16(a, c);
+      __m128i pc = _mm_add_epi16(pa, pb);
+      pa = abs16(pa);
+      pb = abs16(pb);
+      pc = abs16(pc);
+      __m128i const smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+      __m128i const nearest = select(_mm_cmpeq_epi16(smallest, pa), a, select(_mm_cmpeq_epi16(smallest, pb), b, c));
+      __m128i const d = _mm_sub_epi8(load8(row + i), nearest);
+      _mm_storel_epi64(reinterpret_cast<__m128i*>(out + i), _mm_packus_epi16(_mm_and_si128(d, _mm_set1_epi16(0xff)), zero));
+    }
+    paethFilter<Bpp>(out, row, prev, size, i);
+  }
+
+  size_t sumAbsSSE2(Byte const* row, size_t size) {
+    __m128i const zero = _mm_setzero_si128();
+    __m128i sum = zero;
+    size_t i{0};
+    for(; i + 16 <= size; i += 16) {
+      __m128i const v = loadu(row + i);
+      // 符号付きの絶対値は min(v, 256 - v)。-128 も 128 になる。
+      __m128i const abs = _mm_min_epu8(v, _mm_sub_epi8(zero, v));
+      sum = _mm_add_epi64(sum, _mm_sad_epu8(abs, zero));
+    }
+    return static_cast<size_t>(_mm_cvtsi128_si64(sum)) + static_cast<size_t>(_mm_cvtsi128_si64(_mm_unpackhi_epi64(sum, sum)))
+      + sumAbsScalar(row + i, size - i);
+  }
+#endif
+
+  template<size_t Bpp>
+  std::array<FilterFunc, 5> bppFilters() {
+#if defined(__SSE2__)
+    return {noneFilter, subFilterSSE2<Bpp>, upFilterSSE2, averageFilterSSE2<Bpp>, paethFilterSSE2<Bpp>};
+#else
+    return {
+      noneFilter,
+      [](Byte* out, Byte const* row, Byte const* prev, size_t size) { subFilter<Bpp>(out, row, prev, size); },
+      [](Byte* out, Byte const* row, Byte const* prev, size_t size) { upFilter(out, row, prev, size); },
+      [](Byte* out, Byte const* row, Byte const* prev, size_t size) { averageFilter<Bpp>(out, row, prev, size); },
+      [](Byte* out, Byte const* row, Byte const* prev, size_t size) { paethFilter<Bpp>(out, row, prev, size); },
+    };
+#endif
+  }
+
+  std::array<FilterFunc, 5> filters(size_t bpp) {
+    switch(bpp) {
+    case 1: return bppFilters<1>();
+    case 2: return bppFilters<2>();
+    case 3: return bppFilters<3>();
+    case 4: return bppFilters<4>();
+    case 6: return bppFilters<6>();
+    default: return bppFilters<8>();
+    }
+  }
+
+  size_t sumAbs(Byte const* row, size_t size) {
+#if defined(__SSE2__)
+    return sumAbsSSE2(row, size);
+#else
+    return sumAbsScalar(row, size);
+#endif
+  }
+}
@@ -0,0 +1,24 @@
+#include <array>
+#include <cstddef>
+
+#include "byte.h"
+
+#pragma once
+
+namespace Filter {
+  // row を prev (1つ上の行) を使って元に戻す。size は行のバイト数(フィルタタイプを含まない)。
+  using RowFunc = void (*)(Byte* row, Byte const* prev, size_t size);
+
+  // 1画素のバイト数(bpp)ごとの逆フィルタ。添字はフィルタタイプ。
+  // 画像ごとに一度だけ選び、行ごとにフィルタタイプで引く。
+  using Unfilters = std::array<RowFunc, 5>;
+  Unfilters unfilters(size_t bpp);
+
+  // エンコード側。row を prev (1つ上の元の行) を使ってフィルタし、out に書く。
+  using FilterFunc = void (*)(Byte* out, Byte const* row, Byte const* prev, size_t size);
+  using Filters = std::array<FilterFunc, 5>;
+  Filters filters(size_t bpp);
+
+  // フィルタ後の各バイトを符号付きとみなした絶対値の和。小さいほど圧縮しやすいとみなす。
+  size_t sumAbs(Byte const* row, size_t size);
+}
@@ -4,18 +4,28 @@
 #include <array>
 #include <cmath>
 #include <cstdint>
+#include <cstring>
 #include <cctype>
 #include <sstream>
 #include <algorithm>
 #include <optional>
 #include <variant>
 #include <iomanip>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "gif.h"
 #include "byte.h"
 #include "read.h"
 #include "to_string.h"
 #include "lzw.h"
+#include "deflate.h"
+#include "quantize.h"
 
 using std::begin;
 using std::end;
@@ -82,13 +92,10 @@ namespace GIF {
     int lzwSize;
     std::vector<Byte> imageData;
 
-    std::vector<Pixel> pixels();
-    std::vector<Pixel> pixelsWithGct(std::vector<Pixel> const& gct);
-
-  private:
-    std::vector<Pixel> pixelsWithColorTable(std::vector<Pixel> const& ct);
+    // 色の番号を、インターレースを解いて上の行から順に並べたもの。データが足りなければ残りは 0。
+    std::vector<Byte> indices() const;
   };
-  std::string show(ImageDescripter desc) {
+  std::string show(ImageDescripter const& desc) {
     std::stringstream ss;
     ss << "Image Descripter" << std::endl;
     ss << "  hasLct?: " << desc.hasLct << std::endl;
@@ -98,48 +105,29 @@ namespace GIF {
     ss << "  pos: (" << desc.leftPos << ", " << desc.topPos << ")" << std::endl;
     ss << "  size: (" << desc.width << ", " << desc.height << ")" << std::endl;
 
-    auto decoded = LZW::decompress(desc.imageData, desc.lzwSize);
-
     return ss.str();
   }
-  std::vector<Pixel> ImageDescripter::pixelsWithColorTable(std::vector<Pixel> const& ct) {
-    std::vector<Pixel> v;
-    std::cout << "  imagedata size :" << this->imageData.size() << std::endl;
-    auto decoded = LZW::decompress(this->imageData, lzwSize);
-    std::cout << "  decoded size: " << decoded.size() << std::endl;
-
-    if(this->interlaced) {
-      size_t offset{};
-      v.resize(this->width * this->height);
-      auto interlace = [&](size_t begin, size_t step) {
-        for(size_t h{begin}; h < this->height; h += step) {
-          for(size_t w{}; w < this->width; ++w) {
-            v[(h * this->width) + w] = ct[decoded[offset++]];
-          }
-        }
-      };
-      interlace(0, 8);
-      interlace(4, 8);
-      interlace(2, 4);
-      interlace(1, 2);
-    } else {
-      for(size_t i{}; i < decoded.size(); ++i) {
-        v.push_back(ct[decoded[i]]);
-      }
+  std::vector<Byte> ImageDescripter::indices() const {
+    std::vector<Byte> decoded(this->width * this->height);
+    LZW::decompress(this->imageData.data(), this->imageData.size(), lzwSize, decoded.data(), decoded.size());
+    if(!this->interlaced) {
+      return decoded;
     }
-    std::cout << "pixels count: " << v.size() << std::endl;
-
+    // 8 行おきに 0 行目から、8 行おきに 4 行目から、4 行おきに 2 行目から、2 行おきに 1 行目から、の順に並んでいる。
+    std::vector<Byte> v(decoded.size());
+    Byte const* row = decoded.data();
+    auto interlace = [&](size_t begin, size_t step) {
+      for(size_t h{begin}; h < this->height; h += step) {
+        std::copy_n(row, this->width, v.data() + h * this->width);
+        row += this->width;
+      }
+    };
+    interlace(0, 8);
+    interlace(4, 8);
+    interlace(2, 4);
+    interlace(1, 2);
     return v;
   }
-  std::vector<Pixel> ImageDescripter::pixels() {
-    if(!hasLct) {
-      throw;
-    }
-    return pixelsWithColorTable(this->lct);
-  }
-  std::vector<Pixel> ImageDescripter::pixelsWithGct(std::vector<Pixel> const& gct) {
-    return pixelsWithColorTable(gct);
-  }
 
 
   Byte static const ApplicationExtensionLabel{0xff};
@@ -149,7 +137,7 @@ namespace GIF {
     int functionCode;
     std::vector<Byte> data;
   };
-  std::string show(ImageExtension ext) {
+  std::string show(ImageExtension const& ext) {
     std::stringstream ss;
     ss << "Image Extension code: 0x" << std::hex << ext.functionCode;
     if(ext.functionCode == 0xfe) {
@@ -165,7 +153,7 @@ namespace GIF {
     std::array<Byte, 3> authenticationCode;
     std::vector<Byte> data;
   };
-  std::string show(ApplicationExtension ext) {
+  std::string show(ApplicationExtension const& ext) {
     std::stringstream ss;
     ss << "Application Extension" << std::endl;
     ss << "  identifier: " << ext.identifier << std::endl;
@@ -188,7 +176,7 @@ namespace GIF {
     int delayTime;
     int transparentColorIndex;
   };
-  std::string show(GraphicControlExtension ext) {
+  std::string show(GraphicControlExtension const& ext) {
     std::stringstream ss;
     ss << "GraphicControlExtension" << std::endl;
     ss << "  disposalMethod: " << ext.disposalMethod << ", expectUserInput?: " << ext.expectUserInput << ", hasTransparent?: " << ext.hasTransparentColor << ", delay: " << ext.delayTime << ", trans index: " << ext.transparentColorIndex << std::endl;
@@ -214,30 +202,753 @@ namespace GIF {
     Header header;
     std::vector<Block> blocks;
 
-    std::unique_ptr<Image> render();
-    int imageDescripterCount() {
-      return count_if(begin(blocks), end(blocks), [](auto e) { return std::holds_alternative<ImageDescripter>(e); });
+    std::unique_ptr<Image> render() const;
+  };
+
+  // 1枚のフレームと、その直前にあった GraphicControlExtension(無ければ既定の値)。
+  struct Frame {
+    ImageDescripter const* desc;
+    GraphicControlExtension control;
+  };
+
+  std::vector<Frame> frames(Gif const& gif) {
+    GraphicControlExtension const none{0, false, false, 0, 0};
+    std::vector<Frame> v;
+    GraphicControlExtension control{none};
+    for(Block const& block: gif.blocks) {
+      if(auto c = std::get_if<GraphicControlExtension>(&block)) {
+        control = *c;
+      } else if(auto desc = std::get_if<ImageDescripter>(&block)) {
+        v.push_back(Frame{desc, control});
+        control = none;
+      }
+    }
+    return v;
+  }
+
+  // src のうち mask が 0 でないバイトだけを dst に写す。
+  void maskedCopy(Byte* dst, Byte const* src, Byte const* mask, size_t size) {
+    size_t i{0};
+#if defined(__SSE2__)
+    for(; i + 16 <= size; i += 16) {
+      __m128i const m = _mm_loadu_si128(reinterpret_cast<__m128i const*>(mask + i));
+      __m128i const s = _mm_loadu_si128(reinterpret_cast<__m128i const*>(src + i));
+      __m128i const d = _mm_loadu_si128(reinterpret_cast<__m128i const*>(dst + i));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_or_si128(_mm_and_si128(m, s), _mm_andnot_si128(m, d)));
+    }
+#endif
+    for(; i < size; ++i) {
+      dst[i] = mask[i] ? src[i] : dst[i];
     }
+  }
+
+  // キャンバスの中の長方形。
+  struct Rect {
+    size_t left, top, width, height;
   };
 
-  std::unique_ptr<Image> Gif::render() {
-    auto width = header.width;
-    auto height = header.height;
-    std::vector<Pixel> pixels(width * height);
-    auto desc = std::get<ImageDescripter>(*find_if(begin(blocks), end(blocks), [](auto e) { return std::holds_alternative<ImageDescripter>(e); }));
-    if(imageDescripterCount() == 1 && desc.leftPos == 0 && desc.topPos == 0 && desc.width == width && desc.height == height) {
-      std::cout << "its easy!" << std::endl;
-      return std::make_unique<Image>(width, height, desc.hasLct ? desc.pixels() : desc.pixelsWithGct(header.gct));
+  // フレームを1枚のキャンバスに順に描いていく。持つのはキャンバスと、disposal が「前に戻す」の時の退避領域だけ。
+  class Compositor {
+  public:
+    // 次のフレームを描くのに要る状態をまるごと写したもの。ここから描き続ければ、始めから描いたのと同じになる。
+    // たくさん持っておけるように、キャンバスと退避した分は deflate で縮めて持つ。
+    struct Snapshot {
+      std::vector<Byte> canvas;
+      std::vector<Byte> backup;
+      Rect last;
+      int lastDisposal;
+    };
+
+    Compositor(Header const& header)
+      : header_{header},
+        background_{header.hasGct && static_cast<size_t>(header.bgColorIndex) < header.gct.size() ? header.gct[header.bgColorIndex] : Pixel{}},
+        canvas_{header.width, header.height, Pixels(header.width * header.height, background_)} {
+      reset();
+    }
+
+    void reset() {
+      std::fill(begin(canvas_.pixels()), end(canvas_.pixels()), background_);
+      last_ = Rect{0, 0, 0, 0};
+      lastDisposal_ = 0;
     }
 
-    std::cout << "bie" << std::endl;
-    return std::make_unique<Image>(width, height, pixels);
+    // 直前のフレームの disposal を済ませてから、フレームを描く。indices は desc.indices() の結果。
+    void draw(ImageDescripter const& desc, GraphicControlExtension const& control, std::vector<Byte> const& indices) {
+      dispose();
+      Rect const rect = clip(desc);
+      if(control.disposalMethod == 3) {
+        backup_.resize(rect.width * rect.height);
+        for(size_t y{0}; y < rect.height; ++y) {
+          std::copy_n(row(rect, y), rect.width, backup_.data() + y * rect.width);
+        }
+      }
+      last_ = rect;
+      lastDisposal_ = control.disposalMethod;
+
+      // 色表に無い番号は黒にする。
+      std::array<Pixel, 256> ct{};
+      std::vector<Pixel> const& table = desc.hasLct ? desc.lct : header_.gct;
+      std::copy_n(begin(table), std::min<size_t>(table.size(), ct.size()), begin(ct));
+      int const transparent = control.hasTransparentColor ? control.transparentColorIndex : -1;
+
+      std::vector<Pixel> colors(rect.width);
+      std::vector<Byte> mask(transparent >= 0 ? rect.width * sizeof(Pixel) : 0);
+      for(size_t y{0}; y < rect.height; ++y) {
+        Byte const* index = indices.data() + (y + rect.top - desc.topPos) * desc.width + (rect.left - desc.leftPos);
+        if(transparent < 0) {
+          std::transform(index, index + rect.width, row(rect, y), [&](Byte i) { return ct[i]; });
+          continue;
+        }
+        for(size_t x{0}; x < rect.width; ++x) {
+          colors[x] = ct[index[x]];
+          std::fill_n(mask.data() + x * sizeof(Pixel), sizeof(Pixel), index[x] == transparent ? 0 : 0xff);
+        }
+        maskedCopy(reinterpret_cast<Byte*>(row(rect, y)), reinterpret_cast<Byte const*>(colors.data()), mask.data(), mask.size());
+      }
+    }
+
+    Image const& canvas() const { return canvas_; }
+
+    // 退避した分は次の dispose で戻す時(disposal 3)にしか使わないので、その時だけ覚える。
+    Snapshot save() const {
+      Pixels const& pixels = canvas_.pixels();
+      Snapshot snapshot{pack(pixels.data(), pixels.size()), {}, last_, lastDisposal_};
+      if(lastDisposal_ == 3) {
+        snapshot.backup = pack(backup_.data(), backup_.size());
+      }
+      return snapshot;
+    }
+
+    // 縮めたものが壊れていれば false で、その時の状態は決まらないので reset() から描き直すこと。
+    bool restore(Snapshot const& snapshot) {
+      Pixels& pixels = canvas_.pixels();
+      backup_.resize(snapshot.lastDisposal == 3 ? snapshot.last.width * snapshot.last.height : 0);
+      if(!unpack(snapshot.canvas, pixels.data(), pixels.size()) || (!backup_.empty() && !unpack(snapshot.backup, backup_.data(), backup_.size()))) {
+        return false;
+      }
+      last_ = snapshot.last;
+      lastDisposal_ = snapshot.lastDisposal;
+      return true;
+    }
+
+  private:
+    static std::vector<Byte> pack(Pixel const* pixels, size_t size) {
+      return Deflate::compress(reinterpret_cast<Byte const*>(pixels), size * sizeof(Pixel), Deflate::Level::Fast);
+    }
+
+    static bool unpack(std::vector<Byte> const& packed, Pixel* pixels, size_t size) {
+      return Deflate::decompress(packed.data(), packed.size(), reinterpret_cast<Byte*>(pixels), size * sizeof(Pixel));
+    }
+
+    // キャンバスからはみ出さないように切り詰めたフレームの範囲。
+    Rect clip(ImageDescripter const& desc) const {
+      size_t const left = std::min<size_t>(desc.leftPos, header_.width);
+      size_t const top = std::min<size_t>(desc.topPos, header_.height);
+      return Rect{left, top, std::min(desc.width, header_.width - left), std::min(desc.height, header_.height - top)};
+    }
+
+    Pixel* row(Rect const& rect, size_t y) {
+      return canvas_.pixels().data() + (rect.top + y) * header_.width + rect.left;
+    }
+
+    // 2 は背景色で塗り、3 は描く前に退避しておいた分を戻す。0 と 1 はそのまま残す。
+    void dispose() {
+      for(size_t y{0}; y < last_.height; ++y) {
+        if(lastDisposal_ == 2) {
+          std::fill_n(row(last_, y), last_.width, background_);
+        } else if(lastDisposal_ == 3) {
+          std::copy_n(backup_.data() + y * last_.width, last_.width, row(last_, y));
+        }
+      }
+    }
+
+    Header const& header_;
+    Pixel const background_;
+    Image canvas_;
+    std::vector<Pixel> backup_;
+    Rect last_;
+    int lastDisposal_;
+  };
+
+  // 最初のフレームが透明な画素を持たずに画面全体を覆っていれば、色の番号と色表のまま IndexedImage にする。
+  // そうでなければ背景の上に合成する。
+  std::unique_ptr<Image> Gif::render() const {
+    Compositor compositor{header};
+    std::vector<Frame> const fs = frames(*this);
+    if(fs.empty()) {
+      return std::make_unique<Image>(compositor.canvas());
+    }
+    ImageDescripter const& desc = *fs.front().desc;
+    GraphicControlExtension const& control = fs.front().control;
+    std::vector<Byte> indices = desc.indices();
+    std::vector<Pixel> palette = desc.hasLct ? desc.lct : header.gct;
+    bool const covers = desc.leftPos == 0 && desc.topPos == 0 && desc.width == header.width && desc.height == header.height;
+    bool const transparent = control.hasTransparentColor && std::find(begin(indices), end(indices), control.transparentColorIndex) != end(indices);
+    if(covers && !transparent && !palette.empty()) {
+      // 色表に無い番号は黒にする(Compositor と同じ)。
+      Byte const last = indices.empty() ? 0 : *std::max_element(begin(indices), end(indices));
+      if(last >= palette.size()) {
+        palette.resize(last + 1);
+      }
+      return std::make_unique<IndexedImage>(header.width, header.height, std::move(indices), std::move(palette));
+    }
+    compositor.draw(desc, control, indices);
+    return std::make_unique<Image>(compositor.canvas());
+  }
+
+  // 画像データを読み飛ばしながらファイルを一度なめて覚えておく、各フレームの位置と GraphicControlExtension。
+  // desc の imageData は空で、画像データはファイルの data の位置からサブブロックとして読む。
+  struct FrameEntry {
+    ImageDescripter desc;
+    GraphicControlExtension control;
+    std::streampos data;
+  };
+  struct FrameIndex {
+    Header header;
+    std::vector<FrameEntry> frames;
+  };
+
+  bool readSubBlocks(std::istream& fs, std::vector<Byte>& out);
+
+  // 索引にあるフレームの画像データをファイルから読んで伸長する。
+  // ファイルは1つを複数のスレッドで使うので、読む間だけ鍵をかける。伸長は鍵の外で行う。
+  class FrameReader {
+  public:
+    FrameReader(std::istream& fs, std::vector<FrameEntry> const& frames) : fs_{fs}, frames_{frames} {}
+
+    // i 番目のフレームの色の番号。ImageDescripter::indices() と同じ。
+    std::vector<Byte> indices(size_t i) {
+      ImageDescripter desc = frames_[i].desc;
+      {
+        std::lock_guard<std::mutex> lock{mutex_};
+        // 索引を作る時に終わりまで読んでいれば eof が立っているので、消してから戻る。
+        fs_.clear();
+        fs_.seekg(frames_[i].data);
+        readSubBlocks(fs_, desc.imageData);
+      }
+      return desc.indices();
+    }
+
+  private:
+    std::istream& fs_;
+    std::vector<FrameEntry> const& frames_;
+    std::mutex mutex_;
+  };
+
+  // フレームの LZW を先読みして、合成とは別のスレッドで伸長しておく。
+  // 各フレームの LZW 列は互いに関係しないので、どの順に伸長してもよい。合成だけは順に行う。
+  // 持つのは、合成がまだ受け取っていない window 枚分までの伸長結果だけ。先読みするのは last の手前まで。
+  class Prefetcher {
+  public:
+    Prefetcher(FrameReader& reader, size_t first, size_t last)
+      : reader_{reader}, last_{last}, next_{first}, consumed_{first}, stop_{false} {
+      size_t const threads = std::min<size_t>(last - std::min(first, last), std::thread::hardware_concurrency());
+      // 1コアなら先読みしても速くならないので、受け取る時にその場で伸長する。
+      if(threads <= 1) {
+        return;
+      }
+      window_ = threads * 2;
+      slots_.resize(window_);
+      ready_.resize(window_);
+      for(size_t t{0}; t < threads; ++t) {
+        workers_.emplace_back([this]() { work(); });
+      }
+    }
+
+    ~Prefetcher() {
+      {
+        std::lock_guard<std::mutex> lock{mutex_};
+        stop_ = true;
+      }
+      wanted_.notify_all();
+      for(auto& th: workers_) {
+        th.join();
+      }
+    }
+
+    // 次に take() できるフレームの番号と、先読みする範囲の終わり。
+    size_t next() const { return consumed_; }
+    size_t last() const { return last_; }
+
+    // i 番目のフレームの色の番号。i は作った時の first から順に1つずつ、last の手前まで受け取ること。
+    std::vector<Byte> take(size_t i) {
+      if(workers_.empty()) {
+        consumed_ = i + 1;
+        return reader_.indices(i);
+      }
+      std::unique_lock<std::mutex> lock{mutex_};
+      done_.wait(lock, [&]() { return ready_[i % window_]; });
+      std::vector<Byte> v = std::move(slots_[i % window_]);
+      ready_[i % window_] = false;
+      consumed_ = i + 1;
+      lock.unlock();
+      wanted_.notify_all();
+      return v;
+    }
+
+  private:
+    void work() {
+      while(true) {
+        std::unique_lock<std::mutex> lock{mutex_};
+        wanted_.wait(lock, [&]() { return stop_ || (next_ < last_ && next_ < consumed_ + window_); });
+        if(stop_) {
+          return;
+        }
+        size_t const i = next_++;
+        lock.unlock();
+        std::vector<Byte> v = reader_.indices(i);
+        lock.lock();
+        slots_[i % window_] = std::move(v);
+        ready_[i % window_] = true;
+        lock.unlock();
+        done_.notify_all();
+      }
+    }
+
+    FrameReader& reader_;
+    size_t const last_;
+    size_t window_{0};
+    std::vector<std::vector<Byte>> slots_;
+    std::vector<bool> ready_;
+    size_t next_;
+    size_t consumed_;
+    bool stop_;
+    std::mutex mutex_;
+    std::condition_variable wanted_;
+    std::condition_variable done_;
+    // 最後に置いて、他のメンバを作り終えてから動かす。
+    std::vector<std::thread> workers_;
+  };
+
+  struct Animation::State {
+    State(std::istream& fs, FrameIndex&& index_) : index{std::move(index_)}, reader{fs, index.frames}, compositor{index.header} {
+      size_t time{0};
+      for(auto const& frame: index.frames) {
+        starts.push_back(time);
+        time += frame.control.delayTime;
+      }
+    }
+
+    // checkpointInterval 枚ごとに、そのフレームまで描いたところを覚えておく。覚えるのは描いた時だけ。
+    // i 番目を描くには、i より前で最も近いもの(今のキャンバスの方が近ければそれ)から描き足す。
+    Image const& render(size_t i) {
+      size_t const none = index.frames.size();
+      size_t from;
+      size_t const checkpoint = checkpoints.empty() ? none : std::min(i / checkpointInterval, checkpoints.size() - 1);
+      if(current != none && current <= i && (checkpoint == none || current >= checkpoint * checkpointInterval)) {
+        from = current + 1;
+      } else if(checkpoint != none && compositor.restore(checkpoints[checkpoint])) {
+        from = checkpoint * checkpointInterval + 1;
+      } else {
+        compositor.reset();
+        from = 0;
+      }
+      if(from <= i) {
+        // 次のフレームへ進む時は終わりまで先読みする。飛ぶ時は i より先を伸長しても無駄になりやすいので、i までにする。
+        bool const sequential = current != none && i == current + 1;
+        if(!prefetcher || prefetcher->next() != from || prefetcher->last() <= i) {
+          prefetcher.reset();
+          prefetcher = std::make_unique<Prefetcher>(reader, from, sequential ? none : i + 1);
+        }
+      }
+      for(; from <= i; ++from) {
+        FrameEntry const& frame = index.frames[from];
+        compositor.draw(frame.desc, frame.control, prefetcher->take(from));
+        if(from % checkpointInterval == 0 && from / checkpointInterval == checkpoints.size()) {
+          addCheckpoint();
+        }
+      }
+      current = i;
+      return compositor.canvas();
+    }
+
+    // 縮めたキャンバスの合計が checkpointBudget バイトを超えたら、1つおきに捨てて間隔を倍にする。
+    // 残ったものは倍の間隔で並ぶので、i 番目の checkpoint は常に i * checkpointInterval 番目のフレーム。
+    // 最初の1つ(フレーム 0)は残すので、キャンバス1枚が上限より大きくてもそれだけは持つ。
+    void addCheckpoint() {
+      checkpoints.push_back(compositor.save());
+      checkpointBytes += bytes(checkpoints.back());
+      while(checkpointBytes > checkpointBudget && checkpoints.size() > 1) {
+        std::vector<Compositor::Snapshot> kept;
+        checkpointBytes = 0;
+        for(size_t k{0}; k < checkpoints.size(); k += 2) {
+          checkpointBytes += bytes(checkpoints[k]);
+          kept.push_back(std::move(checkpoints[k]));
+        }
+        checkpoints = std::move(kept);
+        checkpointInterval *= 2;
+      }
+    }
+
+    static size_t bytes(Compositor::Snapshot const& snapshot) {
+      return snapshot.canvas.size() + snapshot.backup.size();
+    }
+
+    inline static size_t const checkpointBudget{64 * 1024 * 1024};
+    size_t checkpointInterval{16};
+    size_t checkpointBytes{0};
+    FrameIndex const index;
+    FrameReader reader;
+    Compositor compositor;
+    // 各フレームを表示し始める時刻(1/100 秒)。
+    std::vector<size_t> starts;
+    std::vector<Compositor::Snapshot> checkpoints;
+    // キャンバスに今描いてあるフレーム。まだ何も描いていなければ frames.size()。
+    size_t current{index.frames.size()};
+    std::unique_ptr<Prefetcher> prefetcher;
+  };
+
+  Animation::Animation(std::unique_ptr<State>&& state_) : state{std::move(state_)} {}
+  Animation::~Animation() = default;
+
+  size_t Animation::width() const { return state->index.header.width; }
+  size_t Animation::height() const { return state->index.header.height; }
+  size_t Animation::frameCount() const { return state->index.frames.size(); }
+
+  Image const& Animation::render(size_t frame) {
+    if(frameCount() == 0) {
+      return state->compositor.canvas();
+    }
+    return state->render(std::min(frame, frameCount() - 1));
+  }
+
+  void Animation::prepare() {
+    if(frameCount() != 0) {
+      state->render(frameCount() - 1);
+    }
+  }
+
+  size_t Animation::frameAt(size_t time) const {
+    auto const& starts = state->starts;
+    size_t const i = std::upper_bound(starts.begin(), starts.end(), time) - starts.begin();
+    return i > 0 ? i - 1 : 0;
   }
 
-  std::unique_ptr<Image> exportGIF(std::unique_ptr<Image>&& img, std::ostream&) {
+  Animation::Iterator Animation::begin() {
+    return Iterator{this, 0};
+  }
+
+  Animation::Iterator Animation::end() {
+    return Iterator{this, frameCount()};
+  }
+
+  Image const& Animation::Iterator::operator*() const {
+    return animation_->render(index_);
+  }
+
+  int Animation::Iterator::delay() const {
+    return animation_->state->index.frames[index_].control.delayTime;
+  }
+
+  Animation::Iterator& Animation::Iterator::operator++() {
+    ++index_;
+    return *this;
+  }
+
+  void putSize(ByteSink& os, size_t size) {
+    os.put(size & 0xff);
+    os.put((size >> 8) & 0xff);
+  }
+
+  // 255 バイトずつのサブブロックに分けて書き、長さ 0 のブロックで終える。
+  void putSubBlocks(ByteSink& os, std::vector<Byte> const& data) {
+    for(size_t offset{0}; offset < data.size(); offset += 255) {
+      size_t const size = std::min<size_t>(255, data.size() - offset);
+      os.put(size);
+      os.write(data.data() + offset, size);
+    }
+    os.put(0);
+  }
+
+  // colors 色が入る色表の大きさ 2^(n + 1) の n。
+  size_t colorTableBits(size_t colors) {
+    size_t n{0};
+    while((size_t{2} << n) < colors && n < 7) {
+      ++n;
+    }
+    return n;
+  }
+
+  // 色表を 2^(n + 1) 色に足りない分は黒で埋めて書く。
+  void putColorTable(ByteSink& os, std::vector<Pixel> const& table, size_t n) {
+    for(size_t i{0}; i < (size_t{2} << n); ++i) {
+      Pixel const p = i < table.size() ? table[i] : Pixel{};
+      os.put(p.r);
+      os.put(p.g);
+      os.put(p.b);
+    }
+  }
+
+  void putGraphicControlExtension(ByteSink& os, GraphicControlExtension const& ext) {
+    os.put(ExtensionIntroducer);
+    os.put(GraphicControlExtensionLabel);
+    os.put(4);
+    os.put(((ext.disposalMethod & 0x07) << 2) | (ext.expectUserInput ? 0x02 : 0) | (ext.hasTransparentColor ? 0x01 : 0));
+    putSize(os, ext.delayTime);
+    os.put(ext.transparentColorIndex);
+    os.put(0);
+  }
+
+  // imageData は LZW で圧縮したもの。局所色表は lct の色数から大きさを決める。
+  void putImageDescripter(ByteSink& os, ImageDescripter const& desc) {
+    size_t const n = colorTableBits(desc.lct.size());
+    os.put(ImageSeparator);
+    putSize(os, desc.leftPos);
+    putSize(os, desc.topPos);
+    putSize(os, desc.width);
+    putSize(os, desc.height);
+    os.put((desc.hasLct ? 0x80 | n : 0) | (desc.interlaced ? 0x40 : 0) | (desc.lctSorted ? 0x20 : 0));
+    if(desc.hasLct) {
+      putColorTable(os, desc.lct, n);
+    }
+    os.put(desc.lzwSize);
+    putSubBlocks(os, desc.imageData);
+  }
+
+  std::unique_ptr<Image> exportGIF(std::unique_ptr<Image>&& img, ByteSink& os) {
+    size_t const width = img->width();
+    size_t const height = img->height();
+    if(width > 0xffff || height > 0xffff) {
+      std::cerr << "too large for gif: " << width << 'x' << height << std::endl;
+      return nullptr;
+    }
+    // 色の番号とパレットを持っていればそのまま書く。
+    // そうでなければ、256 色を超えていれば減色する。256 色以下なら画像の色がそのままパレットになる。
+    auto indexed = dynamic_cast<IndexedImage const*>(img.get());
+    bool const keep = indexed && indexed->hasIndices() && indexed->palette().size() <= 256;
+    std::vector<Pixel> const palette = keep ? indexed->palette() : Quantize::palette(*img);
+    std::vector<Byte> const indices = keep ? indexed->indices() : Quantize::map(*img, palette);
+
+    // LZW の最小の符号長は 2 以上。
+    size_t const n = colorTableBits(palette.size());
+    size_t const minCodeSize = std::max<size_t>(2, n + 1);
+
+    os.write("GIF89a");
+    putSize(os, width);
+    putSize(os, height);
+    // 全体の色表あり、色の解像度 8bit、色表の大きさ n。
+    os.put(0x80 | 0x70 | n);
+    os.put(0);
+    os.put(0);
+    putColorTable(os, palette, n);
+
+    ImageDescripter desc{};
+    desc.width = width;
+    desc.height = height;
+    desc.lzwSize = minCodeSize;
+    desc.imageData = LZW::compress(indices, minCodeSize);
+    putImageDescripter(os, desc);
+    os.put(GifTerminator);
     return std::move(img);
   }
 
+  bool samePixel(Pixel const& a, Pixel const& b) {
+    return a.r == b.r && a.g == b.g && a.b == b.b;
+  }
+
+  // 前のキャンバスと違う画素を全て囲む長方形。違う画素が無ければ大きさ 0。
+  // 前のキャンバスは restore の内側なら before、外側なら after。
+  Rect dirtyRect(Image const& img, Pixels const& after, Pixels const& before, Rect const& restore) {
+    size_t const width = img.width();
+    Pixel const* const pixels = img.pixels().data();
+    size_t left{width}, right{0}, top{img.height()}, bottom{0};
+    // y 行目の [x0, x1) のうち base(行の先頭)と違う画素まで、長方形を広げる。
+    auto extend = [&](size_t y, size_t x0, size_t x1, Pixel const* base) {
+      Pixel const* p = pixels + y * width;
+      if(x0 >= x1 || std::memcmp(p + x0, base + x0, (x1 - x0) * sizeof(Pixel)) == 0) {
+        return;
+      }
+      size_t l{x0};
+      while(samePixel(p[l], base[l])) {
+        ++l;
+      }
+      size_t r{x1};
+      while(samePixel(p[r - 1], base[r - 1])) {
+        --r;
+      }
+      left = std::min(left, l);
+      right = std::max(right, r);
+      top = std::min(top, y);
+      bottom = y + 1;
+    };
+    for(size_t y{0}; y < img.height(); ++y) {
+      Pixel const* const a = after.data() + y * width;
+      if(y < restore.top || y >= restore.top + restore.height) {
+        extend(y, 0, width, a);
+        continue;
+      }
+      extend(y, 0, restore.left, a);
+      extend(y, restore.left, restore.left + restore.width, before.data() + y * width);
+      extend(y, restore.left + restore.width, width, a);
+    }
+    if(left >= right) {
+      return Rect{0, 0, 0, 0};
+    }
+    return Rect{left, top, right - left, bottom - top};
+  }
+
+  // 1枚前のフレームを出す前のキャンバスと、出した後のキャンバスを覚えておく。
+  // 次のフレームが来たら、前のフレームの disposal を 1(残す)と 3(前に戻す)のどちらにすると
+  // 変わる範囲が小さいかを比べて決め、それから前のフレームを書く。
+  struct AnimationWriter::State {
+    State(ByteSink& os_, size_t width_, size_t height_) : os{os_}, width{width_}, height{height_} {}
+
+    // base から変わった画素だけを、その色から作った局所色表で書くフレーム。変わっていない画素は透明にする。
+    void encode(Image const& img, Pixels const& base, Rect const& rect, int delay) {
+      Pixel const* const pixels = img.pixels().data();
+      Pixels crop;
+      std::vector<bool> unchanged;
+      Pixels changed;
+      crop.reserve(rect.width * rect.height);
+      for(size_t y{rect.top}; y < rect.top + rect.height; ++y) {
+        for(size_t x{rect.left}; x < rect.left + rect.width; ++x) {
+          Pixel const& p = pixels[y * width + x];
+          bool const same = !base.empty() && samePixel(p, base[y * width + x]);
+          crop.push_back(p);
+          unchanged.push_back(same);
+          if(!same) {
+            changed.push_back(p);
+          }
+        }
+      }
+      bool const transparent = changed.size() < crop.size();
+      // 透明にする番号を1つ空けておく。
+      std::vector<Pixel> palette = changed.empty()
+        ? std::vector<Pixel>{Pixel{}}
+        : Quantize::palette(Image{changed.size(), 1, std::move(changed)}, Quantize::Options{transparent ? size_t{255} : size_t{256}});
+      std::vector<Byte> indices = Quantize::map(Image{rect.width, rect.height, std::move(crop)}, palette);
+      Byte const transparentIndex = palette.size();
+      if(transparent) {
+        for(size_t i{0}; i < indices.size(); ++i) {
+          if(unchanged[i]) {
+            indices[i] = transparentIndex;
+          }
+        }
+        palette.push_back(Pixel{});
+      }
+
+      size_t const minCodeSize = std::max<size_t>(2, colorTableBits(palette.size()) + 1);
+      pending.leftPos = rect.left;
+      pending.topPos = rect.top;
+      pending.width = rect.width;
+      pending.height = rect.height;
+      pending.hasLct = true;
+      pending.interlaced = false;
+      pending.lctSorted = false;
+      pending.lct = std::move(palette);
+      pending.lzwSize = minCodeSize;
+      pending.imageData = LZW::compress(indices, minCodeSize);
+      pendingControl = GraphicControlExtension{1, false, transparent, delay, transparent ? transparentIndex : 0};
+      hasPending = true;
+    }
+
+    void flushPending() {
+      putGraphicControlExtension(os, pendingControl);
+      putImageDescripter(os, pending);
+      hasPending = false;
+    }
+
+    bool add(Image const& img, int delay) {
+      if(img.width() != width || img.height() != height) {
+        std::cerr << "frame size " << img.width() << 'x' << img.height() << " differs from " << width << 'x' << height << std::endl;
+        return false;
+      }
+      delay = std::clamp(delay, 0, 0xffff);
+      if(!hasPending) {
+        encode(img, {}, Rect{0, 0, width, height}, delay);
+        prev = img.pixels();
+        return true;
+      }
+
+      Rect const previous{static_cast<size_t>(pending.leftPos), static_cast<size_t>(pending.topPos), pending.width, pending.height};
+      Rect const kept = dirtyRect(img, prev, prev, Rect{0, 0, 0, 0});
+      // 最初のフレームの前は背景で、背景をどう見せるかは表示する側によって違うので、戻す先にはしない。
+      Rect const restored = prevBase.empty() ? Rect{0, 0, width, height} : dirtyRect(img, prev, prevBase, previous);
+      bool const restore = restored.width * restored.height < kept.width * kept.height;
+      Rect rect = restore ? restored : kept;
+
+      // 何も変わらなければ、前のフレームを長く見せるだけでよい。
+      if(!restore && rect.width == 0 && pendingControl.delayTime + delay <= 0xffff) {
+        pendingControl.delayTime += delay;
+        return true;
+      }
+      // 変わる画素が無くても、GIF のフレームは 1 画素はいる。その 1 画素は透明になる。
+      if(rect.width == 0) {
+        rect = Rect{0, 0, 1, 1};
+      }
+
+      pendingControl.disposalMethod = restore ? 3 : 1;
+      flushPending();
+      // 次のフレームを描く前のキャンバス。
+      Pixels base = prev;
+      if(restore) {
+        for(size_t y{previous.top}; y < previous.top + previous.height; ++y) {
+          std::copy_n(prevBase.data() + y * width + previous.left, previous.width, base.data() + y * width + previous.left);
+        }
+      }
+      encode(img, base, rect, delay);
+      prevBase = std::move(base);
+      prev = img.pixels();
+      return os.good();
+    }
+
+    bool finish() {
+      if(hasPending) {
+        flushPending();
+      }
+      os.put(GifTerminator);
+      return os.good();
+    }
+
+    ByteSink& os;
+    size_t const width;
+    size_t const height;
+    // 前のフレームの画像と、前のフレームを描く前のキャンバス(最初のフレームなら空)。
+    Pixels prev;
+    Pixels prevBase;
+    // まだ書いていない前のフレーム。disposal は次のフレームを見てから決める。
+    bool hasPending{false};
+    ImageDescripter pending;
+    GraphicControlExtension pendingControl;
+  };
+
+  AnimationWriter::AnimationWriter(std::unique_ptr<State>&& state_) : state{std::move(state_)} {}
+  AnimationWriter::~AnimationWriter() = default;
+
+  std::unique_ptr<AnimationWriter> AnimationWriter::open(ByteSink& os, size_t width, size_t height, int loop) {
+    if(width == 0 || height == 0 || width > 0xffff || height > 0xffff) {
+      std::cerr << "bad size for gif: " << width << 'x' << height << std::endl;
+      return nullptr;
+    }
+    os.write("GIF89a");
+    putSize(os, width);
+    putSize(os, height);
+    // 全体の色表は無し(各フレームが局所色表を持つ)、色の解像度 8bit。
+    os.put(0x70);
+    os.put(0);
+    os.put(0);
+    // 繰り返しの回数を入れる NETSCAPE2.0 拡張。
+    if(loop >= 0) {
+      os.put(ExtensionIntroducer);
+      os.put(ApplicationExtensionLabel);
+      os.put(11);
+      os.write("NETSCAPE2.0");
+      os.put(3);
+      os.put(1);
+      putSize(os, std::min(loop, 0xffff));
+      os.put(0);
+    }
+    return std::unique_ptr<AnimationWriter>{new AnimationWriter{std::make_unique<State>(os, width, height)}};
+  }
+
+  bool AnimationWriter::add(Image const& img, int delay) {
+    return state->add(img, delay);
+  }
+
+  bool AnimationWriter::finish() {
+    return state->finish();
+  }
+
   int readSize(std::istream& fs) {
     auto size = read<std::array<Byte, 2>>(fs);
     return static_cast<int>(size[0]) + (static_cast<int>(size[1]) << 8);
@@ -258,15 +969,42 @@ namespace GIF {
     auto aspect = read<Byte>(fs);
     header.aspectRatio = aspect ? ((aspect + 15.0) / 64) : 0;
     if(header.hasGct) {
-      for(int i{}; i < header.gctSize; ++i) {
-        header.gct.push_back(read<Pixel>(fs));
-      }
+      header.gct = read<std::vector<Pixel>>(fs, header.gctSize);
       std::cout << "gct loaded size: " << header.gctSize << std::endl;
     }
     return header;
   }
 
-  Block readImageDiscripter(std::istream& fs) {
+  // 長さ 0 のブロックまで続くサブブロックの中身を、長さのバイトを除いてつなげて out の後ろに足す。
+  // 長さのバイトを読んだら、その分を out に直接まとめて読む。途中でファイルが尽きたら false。
+  bool readSubBlocks(std::istream& fs, std::vector<Byte>& out) {
+    while(true) {
+      int const size = fs.get();
+      if(size == std::char_traits<char>::eof()) {
+        return false;
+      }
+      if(size == 0) {
+        return true;
+      }
+      size_t const offset = out.size();
+      out.resize(offset + size);
+      if(!fs.read(reinterpret_cast<char*>(out.data() + offset), size)) {
+        out.resize(offset + fs.gcount());
+        return false;
+      }
+    }
+  }
+
+  // 長さ 0 のブロックまで、サブブロックを読まずに飛ばす。
+  void skipSubBlocks(std::istream& fs) {
+    int size;
+    while(size = fs.get(), size != 0 && size != std::char_traits<char>::eof()) {
+      fs.ignore(size);
+    }
+  }
+
+  // 画像データの手前(LZW の最小の符号長)まで読む。
+  ImageDescripter readImageDiscripterHeader(std::istream& fs) {
     ImageDescripter desc;
     desc.leftPos = readSize(fs);
     desc.topPos = readSize(fs);
@@ -279,21 +1017,16 @@ namespace GIF {
     desc.lctSize = std::pow(2, (flags & 0x07) + 1);
 
     if(desc.hasLct) {
-      desc.lct.reserve(desc.lctSize);
-      for(int i{}; i < desc.lctSize; ++i) {
-        desc.lct[i] = read<Pixel>(fs);
-      }
+      desc.lct = read<std::vector<Pixel>>(fs, desc.lctSize);
     }
 
     desc.lzwSize = read<Byte>(fs);
-    int blockSize;
-    while(blockSize = read<Byte>(fs), blockSize) {
-      // std::cout << "reading " << static_cast<int>(blockSize) << " bytes" << std::endl;
-      for(int i{}; i < blockSize; ++i) {
-        auto d = read<Byte>(fs);
-        desc.imageData.push_back(d);
-      }
-    }
+    return desc;
+  }
+
+  Block readImageDiscripter(std::istream& fs) {
+    ImageDescripter desc = readImageDiscripterHeader(fs);
+    readSubBlocks(fs, desc.imageData);
 
     std::cout << desc.imageData.size() << " bytes read" << std::endl;
     return desc;
@@ -313,11 +1046,7 @@ namespace GIF {
 
     ext.authenticationCode = read<std::array<Byte, 3>>(fs);
 
-    int size;
-    while(size = read<Byte>(fs), size) {
-      auto d = read<Byte>(fs);
-      ext.data.push_back(d);
-    }
+    readSubBlocks(fs, ext.data);
 
     return ext;
   }
@@ -353,13 +1082,7 @@ namespace GIF {
     } else if(ext.functionCode == ApplicationExtensionLabel) {
       return readApplicationExtension(fs);
     }
-    Byte cnt;
-    while(cnt = read<Byte>(fs), cnt) {
-      for(int i{}; i < cnt; ++i) {
-        auto d = read<Byte>(fs);
-        ext.data.push_back(d);
-      }
-    }
+    readSubBlocks(fs, ext.data);
     std:: cout << "unknown Image Extensino code: " << std::hex << ext.functionCode << std::endl;
 
     return ext;
@@ -387,7 +1110,7 @@ namespace GIF {
     std::optional<Block> block;
     std::vector<Block> blocks;
     while(block = readBlock(fs), block && !std::holds_alternative<EndOfBlock>(*block)) {
-      blocks.push_back(*block);
+      blocks.push_back(std::move(*block));
     }
     if(!block) { return std::vector<Block>{}; }
     blocks.push_back(EndOfBlock{});
@@ -407,10 +1130,58 @@ namespace GIF {
     Gif gif;
     gif.type = *t;
     gif.header = *header;
-    gif.blocks = blocks;
+    gif.blocks = std::move(blocks);
     return gif;
   }
 
+  // readGif() と同じように読むが、画像データは読み飛ばして位置だけ覚える。
+  // 終わりの印の前にファイルが尽きていれば、そこまでのフレームを返す。
+  std::optional<FrameIndex> readIndex(std::istream& fs) {
+    auto t = readType(fs);
+    if(!t) {
+      std::cout << "not gif file" << std::endl;
+      return std::nullopt;
+    }
+    auto header = readHeader(fs, *t);
+    if(!header) { return std::nullopt; }
+    FrameIndex index{std::move(*header), {}};
+    GraphicControlExtension const none{0, false, false, 0, 0};
+    GraphicControlExtension control{none};
+    int sep;
+    while(sep = fs.get(), sep != std::char_traits<char>::eof() && sep != GifTerminator) {
+      if(sep == 0) {
+        continue;
+      }
+      if(sep == ImageSeparator) {
+        ImageDescripter desc = readImageDiscripterHeader(fs);
+        if(!fs) {
+          break;
+        }
+        std::streampos const data = fs.tellg();
+        if(data == std::streampos(-1)) {
+          std::cerr << "gif stream is not seekable" << std::endl;
+          return std::nullopt;
+        }
+        skipSubBlocks(fs);
+        index.frames.push_back(FrameEntry{std::move(desc), control, data});
+        control = none;
+      } else if(sep == ExtensionIntroducer) {
+        auto block = readImageExtension(fs);
+        if(!fs) {
+          break;
+        }
+        if(!block) { return std::nullopt; }
+        if(auto c = std::get_if<GraphicControlExtension>(&*block)) {
+          control = *c;
+        }
+      } else {
+        std::cout << "unknown block separator: " << std::hex << sep << std::endl;
+        return std::nullopt;
+      }
+    }
+    return index;
+  }
+
   void showInfo(std::istream& fs) {
     auto gif = readGif(fs);
     if(!gif) {
@@ -419,7 +1190,7 @@ namespace GIF {
     }
 
     auto t = gif->type;
-    auto header = gif->header;
+    auto const& header = gif->header;
     auto const& blocks = gif->blocks;
     std::cout << "this is gif" << std::endl;
     std::cout << "gif type is " << show(t) << std::endl;
@@ -428,7 +1199,7 @@ namespace GIF {
     std::cout << "bg index: " << header.bgColorIndex << ", aspect: " << header.aspectRatio << std::endl;
 
     std::cout << blocks.size() << "blocks" << std::endl;
-    for(auto e: blocks) {
+    for(auto const& e: blocks) {
       std::cout << std::visit([](auto& x) { return show(x); }, e);
     }
 
@@ -440,4 +1211,12 @@ namespace GIF {
 
     return gif ? gif->render() : nullptr;
   }
+
+  std::unique_ptr<Animation> Animation::open(std::istream& fs) {
+    auto index = readIndex(fs);
+    if(!index) {
+      return nullptr;
+    }
+    return std::unique_ptr<Animation>{new Animation{std::make_unique<State>(fs, std::move(*index))}};
+  }
 }
@@ -1,10 +1,79 @@
 #include <istream>
 #include <memory>
 #include "image.h"
+#include "sink.h"
 #pragma once
 
 namespace GIF {
   std::unique_ptr<Image> load(std::istream&);
-  std::unique_ptr<Image> exportGIF(std::unique_ptr<Image>&&, std::ostream&);
+  std::unique_ptr<Image> exportGIF(std::unique_ptr<Image>&&, ByteSink&);
   void showInfo(std::istream&);
+
+  // アニメーション GIF のフレームを、1枚のキャンバスに disposal と透明色を反映しながら順に合成して見せる。
+  // open() では各フレームのファイルの中の位置と GraphicControlExtension だけを読み、画像データは描く時に読む。
+  // そのため open() に渡すストリームはシークできて、Animation より長く生きていること。
+  // 描いたフレームのうち 16 フレームごとに、合成したキャンバスを deflate で縮めて覚えておく。
+  // 覚えるのは描いた時だけなので、まだ描いていない先へ飛ぶと、覚えてある最後のところ(無ければ最初)から
+  // そのフレームまでを全て伸長する。prepare() で一度全てを描いておけば、どこへ飛んでも伸長するのは高々 16 フレーム。
+  // ただし縮めたキャンバスの合計は 64MiB までで、超えると1つおきに捨てて間隔を倍にするので、その時は倍ずつ増える。
+  // キャンバスは1枚なので、render() の結果やイテレータの指す画像は、次に別のフレームを描くと書き換わる。
+  class Animation {
+  public:
+    static std::unique_ptr<Animation> open(std::istream&);
+    ~Animation();
+    size_t width() const;
+    size_t height() const;
+    size_t frameCount() const;
+    // 全てのフレームを始めから一度合成して、覚えておくキャンバスを揃える。キャンバスは最後のフレームになる。
+    void prepare();
+
+    // frame 番目まで合成したキャンバス。frame が frameCount() 以上なら最後のフレーム。
+    Image const& render(size_t frame);
+    // 始めから time(1/100 秒)経った時に表示されているフレームの番号。最後のフレームより後なら最後のフレーム。
+    size_t frameAt(size_t time) const;
+
+    class Iterator {
+    public:
+      // 今のフレームまでを合成したキャンバス。render(index) と同じ。
+      Image const& operator*() const;
+      // 今のフレームを表示する時間(1/100 秒)。
+      int delay() const;
+      Iterator& operator++();
+      bool operator==(Iterator const& it) const { return index_ == it.index_; }
+      bool operator!=(Iterator const& it) const { return !(*this == it); }
+    private:
+      friend class Animation;
+      Iterator(Animation* animation, size_t index) : animation_{animation}, index_{index} {}
+      Animation* animation_;
+      size_t index_;
+    };
+    Iterator begin();
+    Iterator end();
+
+  private:
+    struct State;
+    Animation(std::unique_ptr<State>&&);
+    std::unique_ptr<State> state;
+  };
+
+  // 画像を順に受け取って、アニメーション GIF として書く。
+  // 各フレームは前のキャンバスから変わった範囲だけを、その範囲の色から作った局所色表で書き、変わっていない画素は透明にする。
+  // 前のフレームの disposal は、次のフレームを見て変わる範囲が小さくなる方(残すか、前に戻すか)を選ぶ。
+  // そのため各フレームは次の add() か finish() を呼んだ時に書かれる。
+  class AnimationWriter {
+  public:
+    // loop は繰り返す回数で、0 なら限りなく繰り返す。負なら繰り返しの指定を書かない。
+    static std::unique_ptr<AnimationWriter> open(ByteSink&, size_t width, size_t height, int loop = 0);
+    ~AnimationWriter();
+    // delay は表示する時間(1/100 秒)。前のフレームと同じ画像なら、前のフレームの時間に足す。
+    // 大きさが open() で決めたものと違えば false。
+    bool add(Image const&, int delay);
+    // 最後のフレームと終わりの印を書く。
+    bool finish();
+
+  private:
+    struct State;
+    AnimationWriter(std::unique_ptr<State>&&);
+    std::unique_ptr<State> state;
+  };
 }
@@ -1,3 +1,7 @@
+#include <array>
+#include <cstdint>
+#include <cstring>
+
 #include "image.h"
 
 Pixel operator+(Pixel const& lhs, Pixel const& rhs) {
@@ -17,3 +21,23 @@ Pixel operator-(Pixel const& lhs, Pixel const& rhs) {
   p.b = sub(lhs.b, rhs.b);
   return p;
 }
+
+void IndexedImage::expand(Pixels& pixels) const {
+  // パレットを 4 バイトずつの表にしておき、1画素ごとに 4 バイトまとめて書いて 3 バイト進む。
+  // はみ出した 1 バイトは次の画素で上書きされる。最後の画素だけは 3 バイト書く。パレットに無い番号は黒。
+  std::array<uint32_t, 256> table{};
+  for(size_t i{0}; i < _palette.size() && i < table.size(); ++i) {
+    std::memcpy(&table[i], &_palette[i], sizeof(Pixel));
+  }
+  size_t const n = _indices.size();
+  pixels.resize(n);
+  if(n == 0) {
+    return;
+  }
+  Byte* out = reinterpret_cast<Byte*>(pixels.data());
+  Byte const* index = _indices.data();
+  for(size_t i{0}; i + 1 < n; ++i) {
+    std::memcpy(out + i * sizeof(Pixel), &table[index[i]], sizeof(uint32_t));
+  }
+  std::memcpy(out + (n - 1) * sizeof(Pixel), &table[index[n - 1]], sizeof(Pixel));
+}
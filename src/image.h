@@ -1,27 +1,101 @@
+#include <atomic>
 #include <cstddef>
+#include <memory>
+#include <mutex>
 #include <vector>
+#include <utility>
 
 #include "byte.h"
 
 #pragma once
 
+// Pixel{} や std::vector<Pixel>(n) は 0 で埋めるが、Pixel p; や Pixels の大きさを決めた時は値を入れない。
 struct Pixel {
   Byte r, g, b;
-  Pixel() : r{}, g{}, b{} {}
+  Pixel() = default;
   Pixel(Byte r_, Byte g_, Byte b_) : r{r_}, g{g_}, b{b_} {}
 };
+static_assert(sizeof(Pixel) == 3, "Pixel must be tightly packed RGB");
+
+// 大きさを決めた時に要素を既定初期化する(値を入れない)アロケータ。
+template<typename T>
+struct DefaultInitAllocator : std::allocator<T> {
+  template<typename U>
+  struct rebind { using other = DefaultInitAllocator<U>; };
+  template<typename U>
+  void construct(U* p) { ::new(static_cast<void*>(p)) U; }
+  template<typename U, typename... Args>
+  void construct(U* p, Args&&... args) { ::new(static_cast<void*>(p)) U(std::forward<Args>(args)...); }
+};
+
+// 画像の画素の並び。書き出す前に全て埋めるので、確保した時には 0 で埋めない。
+using Pixels = std::vector<Pixel, DefaultInitAllocator<Pixel>>;
 
 Pixel operator+(Pixel const& lhs, Pixel const& rhs);
 Pixel operator-(Pixel const& lhs, Pixel const& rhs);
 
 class Image {
 public:
-  Image(size_t width, size_t height, std::vector<Pixel> pixels) : _width{width}, _height{height}, _pixels{pixels} {}
-  size_t width() { return _width; }
-  size_t height() { return _height; }
-  std::vector<Pixel> const& pixels() { return _pixels; }
+  Image(size_t width, size_t height, Pixels pixels) : _width{width}, _height{height}, _pixels{std::move(pixels)}, _expanded{true} {}
+  // IndexedImage を写すと、色を並べた普通の画像になる。
+  Image(Image const& img) : Image{img.width(), img.height(), img.pixels()} {}
+  virtual ~Image() = default;
+  size_t width() const { return _width; }
+  size_t height() const { return _height; }
+  // IndexedImage では、初めて呼ばれた時に色の番号から作る。複数のスレッドから同時に呼んでもよい。
+  Pixels const& pixels() const {
+    if(!_expanded.load(std::memory_order_acquire)) {
+      expandOnce();
+    }
+    return _pixels;
+  }
+  // 書き換えるために渡すので、IndexedImage はこれ以降、色の番号を持たない普通の画像になる。
+  Pixels& pixels() {
+    if(!_expanded.load(std::memory_order_acquire)) {
+      expandOnce();
+    }
+    detach();
+    return _pixels;
+  }
+protected:
+  // 色をまだ作っていない画像。作り方は expand() で決める。
+  Image(size_t width, size_t height) : _width{width}, _height{height}, _expanded{false} {}
+  virtual void expand(Pixels&) const {}
+  virtual void detach() {}
 private:
+  void expandOnce() const {
+    std::lock_guard<std::mutex> lock{_expandMutex};
+    if(!_expanded.load(std::memory_order_relaxed)) {
+      expand(_pixels);
+      _expanded.store(true, std::memory_order_release);
+    }
+  }
+
   size_t const _width;
   size_t const _height;
-  std::vector<Pixel> _pixels;
+  mutable Pixels _pixels;
+  mutable std::atomic<bool> _expanded;
+  mutable std::mutex _expandMutex;
+};
+
+// 色の番号とパレットで持つ画像。GIF やパレットの PNG をそのまま持ち、パレットを使える書き出しはこれを直接書く。
+// 色を並べたもの(pixels())は要る時に初めて作る。
+class IndexedImage : public Image {
+public:
+  // indices は width * height 個で、どれも palette.size() 未満であること。palette は 1〜256 色。
+  IndexedImage(size_t width, size_t height, std::vector<Byte> indices, std::vector<Pixel> palette)
+    : Image{width, height}, _indices{std::move(indices)}, _palette{std::move(palette)} {}
+  // 書き換えるために pixels() を取り出した後は空。
+  std::vector<Byte> const& indices() const { return _indices; }
+  std::vector<Pixel> const& palette() const { return _palette; }
+  bool hasIndices() const { return !_palette.empty(); }
+protected:
+  void expand(Pixels& pixels) const override;
+  void detach() override {
+    _indices = {};
+    _palette = {};
+  }
+private:
+  std::vector<Byte> _indices;
+  std::vector<Pixel> _palette;
 };
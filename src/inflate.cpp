@@ -0,0 +1,442 @@
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+#include "inflate.h"
+
+namespace Inflate {
+  // 表の1項目は 32bit に詰める。
+  //   bit 0-7:   読み進めるビット数
+  //   bit 8-11:  種類
+  //   bit 12-15: 種類ごとの補助の値(長さや距離の拡張ビット数、副表のビット数、2つ目のリテラルの前までのビット数)
+  //   bit 16-31: 値(リテラル、長さや距離の基数、副表の位置)
+  enum Kind : uint32_t { Invalid, Literal, Literal2, Length, End, Sub, Distance };
+
+  constexpr uint32_t entry(Kind kind, uint32_t bits, uint32_t aux, uint32_t value) {
+    return bits | (kind << 8) | (aux << 12) | (value << 16);
+  }
+  uint32_t bitsOf(uint32_t e) { return e & 0xff; }
+  Kind kindOf(uint32_t e) { return static_cast<Kind>((e >> 8) & 0xf); }
+  uint32_t auxOf(uint32_t e) { return (e >> 12) & 0xf; }
+  uint32_t valueOf(uint32_t e) { return e >> 16; }
+
+  std::array<uint16_t, 29> const lengthBase{3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+  std::array<uint8_t, 29> const lengthExtra{0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+  std::array<uint16_t, 30> const distBase{1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+  std::array<uint8_t, 30> const distExtra{0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+  // 最初の表で引くビット数。それより長い符号は副表で引く。
+  size_t const litBits{11};
+  size_t const distBits{8};
+  size_t const preBits{7};
+  size_t const maxCodeBits{15};
+  // 副表は全て (最長の符号 - 最初の表のビット数) ビットの大きさにする。
+  size_t const litTableSize{(1 << litBits) + 288 * (1 << (maxCodeBits - litBits))};
+  size_t const distTableSize{(1 << distBits) + 32 * (1 << (maxCodeBits - distBits))};
+
+  uint32_t litEntry(size_t sym, uint32_t bits) {
+    if(sym < 256) {
+      return entry(Literal, bits, 0, sym);
+    } else if(sym == 256) {
+      return entry(End, bits, 0, 0);
+    } else if(sym < 286) {
+      return entry(Length, bits, lengthExtra[sym - 257], lengthBase[sym - 257]);
+    }
+    return entry(Invalid, bits, 0, 0);
+  }
+
+  uint32_t distEntry(size_t sym, uint32_t bits) {
+    return sym < 30 ? entry(Distance, bits, distExtra[sym], distBase[sym]) : entry(Invalid, bits, 0, 0);
+  }
+
+  uint32_t preEntry(size_t sym, uint32_t bits) {
+    return entry(Literal, bits, 0, sym);
+  }
+
+  uint32_t reverse(uint32_t code, size_t bits) {
+    uint32_t r{0};
+    for(size_t i{0}; i < bits; ++i, code >>= 1) {
+      r = (r << 1) | (code & 1);
+    }
+    return r;
+  }
+
+  // 符号長の列から標準ハフマン符号の表を作る。符号が多すぎれば false。
+  // 足りない(使われないビット列がある)時はその項目を Invalid のままにし、引いた時に壊れた列とみなす。
+  template<typename F>
+  bool build(uint32_t* table, size_t tableBits, Byte const* lengths, size_t n, F symbolEntry) {
+    std::array<uint16_t, maxCodeBits + 1> count{};
+    for(size_t i{0}; i < n; ++i) {
+      ++count[lengths[i]];
+    }
+    count[0] = 0;
+    int left{1};
+    size_t maxLen{0};
+    for(size_t len{1}; len <= maxCodeBits; ++len) {
+      left = (left << 1) - count[len];
+      if(left < 0) {
+        return false;
+      }
+      if(count[len] != 0) {
+        maxLen = len;
+      }
+    }
+    std::array<uint16_t, maxCodeBits + 2> offset{};
+    for(size_t len{1}; len <= maxCodeBits; ++len) {
+      offset[len + 1] = offset[len] + count[len];
+    }
+    std::array<uint16_t, 320> sorted;
+    for(size_t i{0}; i < n; ++i) {
+      if(lengths[i] != 0) {
+        sorted[offset[lengths[i]]++] = i;
+      }
+    }
+
+    size_t const size{size_t{1} << tableBits};
+    size_t const subBits{maxLen > tableBits ? maxLen - tableBits : 0};
+    std::fill_n(table, size, entry(Invalid, 0, 0, 0));
+    size_t nextSub{size};
+    uint32_t code{0};
+    size_t k{0};
+    for(size_t len{1}; len <= maxLen; ++len, code <<= 1) {
+      for(size_t c{0}; c < count[len]; ++c, ++code) {
+        size_t const sym = sorted[k++];
+        // ビット列は下位から読むので、符号を反転した位置に置く。
+        uint32_t const rev = reverse(code, len);
+        if(len <= tableBits) {
+          for(size_t i{rev}; i < size; i += size_t{1} << len) {
+            table[i] = symbolEntry(sym, len);
+          }
+          continue;
+        }
+        uint32_t& head = table[rev & (size - 1)];
+        if(kindOf(head) != Sub) {
+          head = entry(Sub, tableBits, subBits, nextSub);
+          std::fill_n(table + nextSub, size_t{1} << subBits, entry(Invalid, 0, 0, 0));
+          nextSub += size_t{1} << subBits;
+        }
+        uint32_t* sub = table + valueOf(head);
+        for(size_t i{rev >> tableBits}; i < (size_t{1} << subBits); i += size_t{1} << (len - tableBits)) {
+          sub[i] = symbolEntry(sym, len - tableBits);
+        }
+      }
+    }
+    return true;
+  }
+
+  // 短いリテラルの後に短いリテラルが続くなら、1回引くだけで2つとも出せるようにする。
+  // 後ろの項目ほど先に書き換えるので、i >> bits (i 以下) はまだ元のまま読める。
+  void combineLiterals(uint32_t* table) {
+    for(size_t i{size_t{1} << litBits}; i-- > 0;) {
+      uint32_t const e = table[i];
+      uint32_t const bits = bitsOf(e);
+      if(kindOf(e) != Literal || bits >= litBits) {
+        continue;
+      }
+      // 残りの litBits - bits ビットで次の符号が決まる時だけまとめる。
+      uint32_t const next = table[i >> bits];
+      if(kindOf(next) == Literal && bitsOf(next) <= litBits - bits) {
+        table[i] = entry(Literal2, bits + bitsOf(next), bits, valueOf(e) | (valueOf(next) << 8));
+      }
+    }
+  }
+
+  struct Tables {
+    std::array<uint32_t, litTableSize> lit;
+    std::array<uint32_t, distTableSize> dist;
+  };
+
+  // 固定ハフマン符号の表は1度だけ作る。
+  Tables const& fixedTables() {
+    static Tables const tables = [] {
+      Tables t;
+      std::array<Byte, 288> lit;
+      std::fill(begin(lit), begin(lit) + 144, 8);
+      std::fill(begin(lit) + 144, begin(lit) + 256, 9);
+      std::fill(begin(lit) + 256, begin(lit) + 280, 7);
+      std::fill(begin(lit) + 280, end(lit), 8);
+      std::array<Byte, 32> dist;
+      dist.fill(5);
+      build(t.lit.data(), litBits, lit.data(), lit.size(), litEntry);
+      combineLiterals(t.lit.data());
+      build(t.dist.data(), distBits, dist.data(), dist.size(), distEntry);
+      return t;
+    }();
+    return tables;
+  }
+
+  // 64bit のビットバッファ。入力の終わりを越えた分は 0 を読んだことにして数えておく。
+  class BitReader {
+  public:
+    BitReader(Byte const* src, size_t size) : begin_{src}, in_{src}, end_{src + size}, buf_{0}, count_{0}, overrun_{0} {}
+
+    // 少なくとも 56 ビットをためる。
+    void refill() {
+      if(end_ - in_ >= 8) {
+        uint64_t v;
+        std::memcpy(&v, in_, 8);
+        buf_ |= le64(v) << count_;
+        // 読めた分だけ進める。上に余った半端なビットは次にまた同じ値を読むので、重ねて or してよい。
+        in_ += (63 - count_) >> 3;
+        count_ |= 56;
+        return;
+      }
+      while(count_ <= 56) {
+        uint64_t b{0};
+        if(in_ < end_) {
+          b = *in_++;
+        } else {
+          ++overrun_;
+        }
+        buf_ |= b << count_;
+        count_ += 8;
+      }
+    }
+    uint32_t peek(size_t n) const { return buf_ & ((uint64_t{1} << n) - 1); }
+    void drop(size_t n) {
+      buf_ >>= n;
+      count_ -= n;
+    }
+    uint32_t bits(size_t n) {
+      uint32_t const v = peek(n);
+      drop(n);
+      return v;
+    }
+
+    // 読み終えたビット数。
+    size_t position() const { return (in_ - begin_ + overrun_) * 8 - count_; }
+    size_t size() const { return end_ - begin_; }
+    bool overrun() const { return position() > size() * 8; }
+
+    // バイト境界まで捨て、ためてあるバイトを入力に戻す。格納ブロックを写す前に使う。
+    void align() {
+      drop(count_ % 8);
+      size_t n{count_ / 8};
+      size_t const virt = std::min(n, overrun_);
+      overrun_ -= virt;
+      in_ -= n - virt;
+      buf_ = 0;
+      count_ = 0;
+    }
+    Byte const* in() const { return in_; }
+    size_t available() const { return overrun_ ? 0 : end_ - in_; }
+    void skip(size_t n) { in_ += n; }
+
+  private:
+    static uint64_t le64(uint64_t v) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+      return __builtin_bswap64(v);
+#else
+      return v;
+#endif
+    }
+
+    Byte const* const begin_;
+    Byte const* in_;
+    Byte const* const end_;
+    uint64_t buf_;
+    size_t count_;
+    size_t overrun_;
+  };
+
+  uint32_t decode(uint32_t const* table, size_t tableBits, BitReader& br) {
+    uint32_t e = table[br.peek(tableBits)];
+    if(kindOf(e) == Sub) {
+      br.drop(tableBits);
+      e = table[valueOf(e) + br.peek(auxOf(e))];
+    }
+    return e;
+  }
+
+  // 一致の写し。距離が 8 以上なら 8 バイトずつ写しても読む所はもう書き終えている。
+  // 終わりを最大 7 バイト越えて書くので、出力の終わりまで余裕がある時だけ使う。
+  void copyMatch(Byte* out, size_t dist, size_t length, Byte const* outEnd) {
+    Byte const* src = out - dist;
+    if(dist >= 8 && static_cast<size_t>(outEnd - out) >= length + 8) {
+      for(Byte* const last = out + length; out < last; out += 8, src += 8) {
+        uint64_t v;
+        std::memcpy(&v, src, 8);
+        std::memcpy(out, &v, 8);
+      }
+    } else if(dist == 1) {
+      std::memset(out, *src, length);
+    } else {
+      for(size_t i{0}; i < length; ++i) {
+        out[i] = src[i];
+      }
+    }
+  }
+
+  // 動的ハフマン符号のブロックの頭から、符号長を読んで表を作る。
+  bool readDynamic(BitReader& br, Tables& t) {
+    br.refill();
+    size_t const hlit = br.bits(5) + 257;
+    size_t const hdist = br.bits(5) + 1;
+    size_t const hclen = br.bits(4) + 4;
+    if(hlit > 286 || hdist > 30) {
+      return false;
+    }
+    static std::array<Byte, 19> const order{16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+    std::array<Byte, 19> preLengths{};
+    for(size_t i{0}; i < hclen; ++i) {
+      br.refill();
+      preLengths[order[i]] = br.bits(3);
+    }
+    std::array<uint32_t, 1 << preBits> pre;
+    if(!build(pre.data(), preBits, preLengths.data(), preLengths.size(), preEntry)) {
+      return false;
+    }
+
+    std::array<Byte, 286 + 30> lengths{};
+    for(size_t i{0}; i < hlit + hdist;) {
+      br.refill();
+      uint32_t const e = pre[br.peek(preBits)];
+      if(kindOf(e) == Invalid) {
+        return false;
+      }
+      br.drop(bitsOf(e));
+      uint32_t const sym = valueOf(e);
+      if(sym < 16) {
+        lengths[i++] = sym;
+        continue;
+      }
+      Byte value{0};
+      size_t repeat;
+      if(sym == 16) {
+        if(i == 0) {
+          return false;
+        }
+        value = lengths[i - 1];
+        repeat = 3 + br.bits(2);
+      } else if(sym == 17) {
+        repeat = 3 + br.bits(3);
+      } else {
+        repeat = 11 + br.bits(7);
+      }
+      if(i + repeat > hlit + hdist) {
+        return false;
+      }
+      std::fill_n(begin(lengths) + i, repeat, value);
+      i += repeat;
+    }
+    if(lengths[256] == 0) {
+      return false;
+    }
+    if(!build(t.lit.data(), litBits, lengths.data(), hlit, litEntry) || !build(t.dist.data(), distBits, lengths.data() + hlit, hdist, distEntry)) {
+      return false;
+    }
+    combineLiterals(t.lit.data());
+    return true;
+  }
+
+  Result inflate(Byte const* src, size_t srcSize, Byte* dst, size_t dstSize) {
+    BitReader br{src, srcSize};
+    Byte* out = dst;
+    Byte* const outEnd = dst + dstSize;
+    Tables dynamic;
+    auto result = [&](bool ok, bool final, bool full) {
+      // 入力の終わりを越えて読んでいれば、その後ろは 0 を補って作った出鱈目なので、足りなかったことにもしない。
+      bool const overrun = br.overrun();
+      ok = ok && !overrun;
+      full = full && !overrun;
+      return Result{ok, final, full, (std::min(br.position(), srcSize * 8) + 7) / 8, static_cast<size_t>(out - dst)};
+    };
+
+    while(true) {
+      // 最終でないブロックの切れ目で入力が尽きたら、そこで止める(full flush で区切った途中の断片)。
+      if(br.position() == srcSize * 8) {
+        return result(true, false, false);
+      }
+      br.refill();
+      bool const last = br.bits(1);
+      uint32_t const type = br.bits(2);
+
+      if(type == 0) {
+        br.align();
+        if(br.available() < 4) {
+          return result(false, last, false);
+        }
+        Byte const* p = br.in();
+        size_t const len = p[0] | (p[1] << 8);
+        size_t const nlen = p[2] | (p[3] << 8);
+        br.skip(4);
+        if((len ^ 0xffff) != nlen || br.available() < len) {
+          return result(false, last, false);
+        }
+        if(static_cast<size_t>(outEnd - out) < len) {
+          return result(false, last, true);
+        }
+        std::copy_n(br.in(), len, out);
+        br.skip(len);
+        out += len;
+      } else if(type == 3) {
+        return result(false, last, false);
+      } else {
+        Tables const& t = type == 1 ? fixedTables() : dynamic;
+        if(type == 2 && !readDynamic(br, dynamic)) {
+          return result(false, last, false);
+        }
+        uint32_t const* lit = t.lit.data();
+        uint32_t const* dist = t.dist.data();
+        while(true) {
+          // 1つの長さと距離の組は最長 48 ビットなので、1回ためれば足りる。
+          br.refill();
+          uint32_t const e = decode(lit, litBits, br);
+          Kind const kind = kindOf(e);
+          if(kind == Literal2) {
+            if(outEnd - out >= 2) {
+              br.drop(bitsOf(e));
+              out[0] = valueOf(e);
+              out[1] = valueOf(e) >> 8;
+              out += 2;
+              continue;
+            }
+            // 残りが 1 バイトなら 1 つ目だけ出す。
+            br.drop(auxOf(e));
+            if(out == outEnd) {
+              return result(false, last, true);
+            }
+            *out++ = valueOf(e);
+            continue;
+          }
+          br.drop(bitsOf(e));
+          if(kind == Literal) {
+            if(out == outEnd) {
+              return result(false, last, true);
+            }
+            *out++ = valueOf(e);
+            continue;
+          }
+          if(kind == End) {
+            break;
+          }
+          if(kind != Length) {
+            return result(false, last, false);
+          }
+          size_t const length = valueOf(e) + br.bits(auxOf(e));
+          uint32_t const d = decode(dist, distBits, br);
+          br.drop(bitsOf(d));
+          if(kindOf(d) != Distance) {
+            return result(false, last, false);
+          }
+          size_t const distance = valueOf(d) + br.bits(auxOf(d));
+          if(distance > static_cast<size_t>(out - dst)) {
+            return result(false, last, false);
+          }
+          if(static_cast<size_t>(outEnd - out) < length) {
+            return result(false, last, true);
+          }
+          copyMatch(out, distance, length, outEnd);
+          out += length;
+        }
+      }
+      if(br.overrun()) {
+        return result(false, last, false);
+      }
+      if(last) {
+        return result(true, true, false);
+      }
+    }
+  }
+}
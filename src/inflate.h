@@ -0,0 +1,23 @@
+#include <cstddef>
+
+#include "byte.h"
+
+#pragma once
+
+// 生の deflate 列を、入力も出力も全てメモリにある前提で一度に伸長する。
+// zlib の枠は付けない(Deflate 側で扱う)。
+namespace Inflate {
+  struct Result {
+    // 壊れた列でなく、dst に収まったこと。
+    bool ok;
+    // 最終ブロックまで読んだこと。false なら、最終でないブロックの切れ目でちょうど入力が尽きた。
+    bool final;
+    // dst が足りなかったこと。
+    bool full;
+    // 読んだバイト数(最後の半端なビットを含む)と、書いたバイト数。
+    size_t in;
+    size_t out;
+  };
+
+  Result inflate(Byte const* src, size_t srcSize, Byte* dst, size_t dstSize);
+}
@@ -1,140 +1,303 @@
 #include <algorithm>
-#include <variant>
-#include <optional>
-#include <cmath>
-
-#include <iostream>
-
+#include <array>
+#include <cstdint>
+#include <cstring>
 
 #include "lzw.h"
 
 using std::begin;
+using std::end;
 
 namespace LZW {
-  std::vector<Byte> compress(std::vector<Byte> const&) {
-    std::vector<Byte> v;
-    return v;
-  }
+  // 符号は最大 12 ビットなので、辞書は 4096 項目で足りる。
+  size_t const maxCodeBits{12};
+  size_t const dictSize{1 << maxCodeBits};
 
-  class ClearCode {};
-  class EodCode {};
-  using Output = std::variant<std::vector<Byte>, ClearCode, EodCode>;
+  // 符号を下位ビットから詰めて書く。
+  class BitWriter {
+  public:
+    BitWriter(std::vector<Byte>& out) : out_{out}, buf_{0}, count_{0} {}
 
-  Output static const clearCode{ClearCode{}};
-  Output static const eodCode{EodCode{}};
+    void write(uint32_t code, size_t size) {
+      buf_ |= static_cast<uint64_t>(code) << count_;
+      count_ += size;
+      // 32 ビットたまったらまとめて書く。次の符号(12 ビットまで)を足しても 64 ビットを超えない。
+      if(count_ >= 32) {
+        Byte const bytes[4] = {static_cast<Byte>(buf_), static_cast<Byte>(buf_ >> 8), static_cast<Byte>(buf_ >> 16), static_cast<Byte>(buf_ >> 24)};
+        out_.insert(end(out_), bytes, bytes + 4);
+        buf_ >>= 32;
+        count_ -= 32;
+      }
+    }
 
-  void initDict(int clear, std::vector<Output>& dict) {
-    dict.clear();
-    for(int i{}; i < clear; ++i) {
-      // clear <= 256のハズ……？
-      dict.push_back(std::vector<Byte>{static_cast<Byte>(i)});
+    // 半端なビットを 0 で埋めて書き出す。
+    void finish() {
+      for(; count_ > 0; count_ -= std::min<size_t>(count_, 8)) {
+        out_.push_back(buf_);
+        buf_ >>= 8;
+      }
     }
-    dict.push_back(clearCode);
-    dict.push_back(eodCode);
-  }
 
-  struct Pos {
-    int byte;
-    int bit;
+    // 書いたビット数。
+    size_t bits() const { return out_.size() * 8 + count_; }
+
+  private:
+    std::vector<Byte>& out_;
+    uint64_t buf_;
+    size_t count_;
   };
-  int eat(Pos& pos, size_t size, std::vector<Byte> const& src) { // size は高々12。
-    if(pos.bit + size < 8) {
-      int mask = static_cast<int>(std::pow(2, size) - 1) << (pos.bit + 1);
-      int result = (src[pos.byte] & mask) >> (pos.bit + 1);
-      pos.bit += size;
-      return result;
+
+  // (前の符号, 次のバイト) から符号を引く開番地法のハッシュ表。
+  // 辞書は 4096 項目までなので、その倍の大きさにして探す距離を短くする。
+  class EncodeTable {
+  public:
+    EncodeTable() { clear(); }
+
+    void clear() { keys_.fill(empty); }
+
+    // 見つからなければ -1。
+    int find(uint32_t prefix, Byte b) const {
+      uint32_t const key = (prefix << 8) | b;
+      for(size_t i{slot(key)};; i = (i + 1) & (size - 1)) {
+        if(keys_[i] == key) {
+          return codes_[i];
+        }
+        if(keys_[i] == empty) {
+          return -1;
+        }
+      }
     }
-    // 次のwordにまたがる事が確定。
-    int eaten = 8 - pos.bit;
-    int result = src[pos.byte] >> pos.bit; // 前のword分。
-    int restSize = size - eaten;
-    if(restSize == 0) {
-      pos.bit = 7;
-      return result;
+
+    void insert(uint32_t prefix, Byte b, uint32_t code) {
+      uint32_t const key = (prefix << 8) | b;
+      size_t i{slot(key)};
+      while(keys_[i] != empty) {
+        i = (i + 1) & (size - 1);
+      }
+      keys_[i] = key;
+      codes_[i] = code;
+    }
+
+  private:
+    static size_t slot(uint32_t key) { return (key * 0x9e3779b1u) >> (32 - bits); }
+
+    inline static size_t const bits{13};
+    inline static size_t const size{1 << bits};
+    inline static uint32_t const empty{0xffffffff};
+    std::array<uint32_t, size> keys_;
+    std::array<uint16_t, size> codes_;
+  };
+
+  std::vector<Byte> compress(std::vector<Byte> const& src, size_t size) {
+    std::vector<Byte> v;
+    if(size < 2 || size > 8) {
+      return v;
     }
-    ++pos.byte;
-    if(restSize >= 8) {
-      // 次のwordはまるまる食べる。
-      result += src[pos.byte] << eaten;
-      ++pos.byte;
-      restSize -= 8;
-      eaten += 8;
+    uint32_t const clear = 1 << size;
+    uint32_t const eod = clear + 1;
+    BitWriter writer{v};
+    EncodeTable table;
+    size_t codeSize{size + 1};
+    uint32_t next{clear + 2};
+    writer.write(clear, codeSize);
+    if(src.empty()) {
+      writer.write(eod, codeSize);
+      writer.finish();
+      return v;
     }
-    // ここでrestSizeは8以下。
-    int mask = std::pow(2, restSize) - 1;
-    result += (src[pos.byte] & mask) << eaten;
-    pos.bit = restSize;
-    return result;
-  }
 
-  std::vector<Byte> decompress(std::vector<Byte> const& src, size_t size) {
-    int const clear = std::pow(2, size);
-    std::vector<Output> dict;
-    std::vector<Byte> res;
+    // 辞書がいっぱいになってもすぐにはクリアせず、そのまま使い続ける。
+    // 一定のバイト数ごとに辞書を作り直してからの圧縮率を見て、前に見た時より悪くなっていたらクリアする。
+    size_t const checkInterval{4096};
+    size_t checkAt{0};
+    size_t startIn{0};
+    size_t startBits{0};
+    double lastRatio{0};
+
+    uint32_t prefix = src[0] & (clear - 1);
+    for(size_t i{1}; i < src.size(); ++i) {
+      Byte const b = src[i] & (clear - 1);
+      int const code = table.find(prefix, b);
+      if(code >= 0) {
+        prefix = code;
+        continue;
+      }
+      writer.write(prefix, codeSize);
+      if(next < dictSize) {
+        table.insert(prefix, b, next);
+        // 復号側は1つ遅れて辞書に加えるので、next が 2^codeSize を超えてから符号を長くする。
+        if(next++ == (uint32_t{1} << codeSize) && codeSize < maxCodeBits) {
+          ++codeSize;
+        }
+      } else if(i >= checkAt) {
+        double const ratio = static_cast<double>(i - startIn) / (writer.bits() - startBits);
+        if(ratio < lastRatio) {
+          writer.write(clear, codeSize);
+          table.clear();
+          codeSize = size + 1;
+          next = clear + 2;
+          startIn = i;
+          startBits = writer.bits();
+          lastRatio = 0;
+        } else {
+          lastRatio = ratio;
+        }
+        checkAt = i + checkInterval;
+      }
+      prefix = b;
+    }
+    writer.write(prefix, codeSize);
+    writer.write(eod, codeSize);
+    writer.finish();
+    return v;
+  }
 
-    initDict(clear, dict);
+  // GIF の符号は下位ビットから詰められている。64bit にためておき、符号1つごとに読む。
+  class BitReader {
+  public:
+    BitReader(Byte const* src, size_t size) : in_{src}, end_{src + size}, buf_{0}, count_{0} {}
 
-    size_t currentSize = size + 1;
-    int currentMax = clear * 2;
-    std::optional<int> localCode{};
-    Pos pos{};
-    bool fullDict{};
-    while(true) {
-      if(!(static_cast<int>(dict.size()) < 4096)) {
-        // std::cout << "dict full! expect following clear code!" << std::endl;
-        fullDict = true;
-      } else if(static_cast<int>(dict.size()) >= currentMax) { // 辞書のサイズは高々2^12。
-        ++currentSize;
-        currentMax *= 2;
-        /*
-        std::cout << "sizeup!" << std::endl;
-        std::cout << "size: " << currentSize << ", max: " << currentMax << std::endl;
-        */
-      }
-      int n = eat(pos, currentSize, src);
-      // std::cout << n << ", ";
-      Output output;
-      if(n >= static_cast<int>(dict.size()) && !fullDict) { // 辞書のサイズは高々2^12。
-        if(n != static_cast<int>(dict.size())) {
-          std::cout << "### too large! something went wrong? n: " << n << ", dict size: " << dict.size() << std::endl;
+    // size ビットの符号を読む。入力が尽きていれば false。
+    bool read(size_t size, uint32_t& code) {
+      if(count_ < size) {
+        refill();
+        if(count_ < size) {
+          return false;
         }
-        if(!localCode) { std::cout << "never come!" << std::endl; }
-        // 入力コードが辞書に無い時は、必ずlocalCodeはvalidである。
-        auto newOne = std::get<std::vector<Byte>>(dict[*localCode]);
-        newOne.push_back(newOne[0]);
-        dict.push_back(newOne);
-        localCode = n;
-        copy(begin(newOne), end(newOne), back_inserter(res));
+      }
+      code = buf_ & ((uint32_t{1} << size) - 1);
+      buf_ >>= size;
+      count_ -= size;
+      return true;
+    }
+
+  private:
+    void refill() {
+      if(end_ - in_ >= 8) {
+        uint64_t v;
+        std::memcpy(&v, in_, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        v = __builtin_bswap64(v);
+#endif
+        buf_ |= v << count_;
+        // 入りきらなかった上位のバイトは次にまた読む。
+        in_ += (63 - count_) >> 3;
+        count_ |= 56;
+        return;
+      }
+      while(count_ <= 56 && in_ < end_) {
+        buf_ |= static_cast<uint64_t>(*in_++) << count_;
+        count_ += 8;
+      }
+    }
+
+    Byte const* in_;
+    Byte const* const end_;
+    uint64_t buf_;
+    size_t count_;
+  };
+
+  // 辞書の項目は「前の項目 + 1バイト」で表し、文字列そのものは持たない。
+  // 長さと先頭のバイトも持っておけば、出力先に後ろから直接書ける。
+  struct Dictionary {
+    std::array<uint16_t, dictSize> prefix;
+    std::array<Byte, dictSize> suffix;
+    std::array<Byte, dictSize> first;
+    std::array<uint16_t, dictSize> length;
+  };
+
+  size_t decompress(Byte const* src, size_t srcSize, size_t minCodeSize, Byte* dst, size_t dstSize) {
+    if(minCodeSize < 1 || minCodeSize > 8) {
+      return 0;
+    }
+    uint32_t const clear = 1 << minCodeSize;
+    uint32_t const eod = clear + 1;
+    Dictionary dict;
+    for(uint32_t i{0}; i < clear; ++i) {
+      dict.prefix[i] = 0;
+      dict.suffix[i] = i;
+      dict.first[i] = i;
+      dict.length[i] = 1;
+    }
+
+    BitReader br{src, srcSize};
+    Byte* out = dst;
+    Byte* const outEnd = dst + dstSize;
+    size_t codeSize{minCodeSize + 1};
+    uint32_t next{clear + 2};
+    // 直前の符号。クリア符号の直後は無い。
+    uint32_t prev{dictSize};
+    uint32_t code;
+    while(out < outEnd && br.read(codeSize, code)) {
+      if(code == clear) {
+        codeSize = minCodeSize + 1;
+        next = clear + 2;
+        prev = dictSize;
         continue;
       }
-      output = dict[n];
-      if(std::holds_alternative<ClearCode>(output)) {
-        initDict(clear, dict);
-        fullDict = false;
-        currentSize = size + 1;
-        currentMax = clear * 2;
-        localCode = std::nullopt;
-        // std::cout << "got clear code! size: " << currentSize << ", max: " << currentMax << std::endl;
+      if(code == eod) {
+        break;
+      }
+      if(prev == dictSize) {
+        if(code >= clear) {
+          break;
+        }
+        *out++ = code;
+        prev = code;
         continue;
-      } else if(std::holds_alternative<EodCode>(output)) {
-        /*
-        std::cout << "got end code!" << std::endl;
-        std::cout << "  dict size: " << dict.size() << std::endl;
-        std::cout << "  pos: (" << pos.byte << ", " << pos.bit << ")" << std::endl;
-        std::cout << "  src size; " << src.size() << std::endl;
-        */
+      }
+      if(code > next || (code == next && next == dictSize)) {
         break;
       }
-      auto out = std::get<std::vector<Byte>>(output);
-      if(localCode) {
-        std::vector<Byte> newOne = std::get<std::vector<Byte>>(dict[*localCode]);
-        newOne.push_back(out[0]);
-        dict.push_back(newOne);
+
+      // 辞書に無い符号(今から作る項目)は、直前の文字列に自身の先頭のバイトを足したもの。
+      bool const known = code < next;
+      uint32_t const string = known ? code : prev;
+      Byte const head = dict.first[string];
+      size_t const length = dict.length[string] + (known ? 0 : 1);
+      if(next < dictSize) {
+        dict.prefix[next] = prev;
+        dict.suffix[next] = head;
+        dict.first[next] = dict.first[prev];
+        dict.length[next] = dict.length[prev] + 1;
+        ++next;
+        if(next == (uint32_t{1} << codeSize) && codeSize < maxCodeBits) {
+          ++codeSize;
+        }
+      }
+      prev = code;
+
+      // 後ろから書く。出力に収まらない後ろの部分は辿るだけで書かない。
+      size_t const room = outEnd - out;
+      size_t pos{length};
+      uint32_t c{known ? code : string};
+      if(!known) {
+        if(--pos < room) {
+          out[pos] = head;
+        }
+      }
+      while(pos > 0) {
+        --pos;
+        if(pos < room) {
+          out[pos] = dict.suffix[c];
+        }
+        c = dict.prefix[c];
       }
-      localCode = n;
-      copy(begin(out), end(out), back_inserter(res));
+      out += std::min(length, room);
     }
+    return out - dst;
+  }
 
-    return res;
+  std::vector<Byte> decompress(std::vector<Byte> const& src, size_t size) {
+    // 伸長後の大きさが分からないので、出力がいっぱいになったら倍にして伸長し直す。
+    std::vector<Byte> res(src.size() * 4 + 64);
+    while(true) {
+      size_t const n = decompress(src.data(), src.size(), size, res.data(), res.size());
+      if(n < res.size()) {
+        res.resize(n);
+        return res;
+      }
+      res.resize(res.size() * 2);
+    }
   }
 }
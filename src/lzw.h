@@ -5,6 +5,10 @@
 #pragma once
 
 namespace LZW {
+  // 色の番号の列を、最小の符号長 size(2〜8)で GIF の LZW 符号にする。サブブロックには分けない。
   std::vector<Byte> compress(std::vector<Byte> const& src, size_t size);
   std::vector<Byte> decompress(std::vector<Byte> const& src, size_t size);
+  // 伸長後の大きさが分かっている時(GIF では幅 x 高さ)はこちらを使う。
+  // dst に最大 dstSize バイト書き、書いたバイト数を返す。壊れた符号が来たらそこまでで止める。
+  size_t decompress(Byte const* src, size_t srcSize, size_t minCodeSize, Byte* dst, size_t dstSize);
 }
@@ -3,25 +3,33 @@
 #include <string>
 #include <fstream>
 #include <functional>
+#include <unistd.h>
 
 #include "png.h"
 #include "pnm.h"
 #include "gif.h"
 #include "jpg.h"
+#include "sink.h"
 
 template<class T, class... Args>
 inline std::array<T, sizeof...(Args)> make_array(Args &&... args) {
   return std::array< T, sizeof...(Args) >{ std::forward<Args>(args)... };
 }
 
+// convert の preset 引数で変わる。
+PNG::ExportOptions pngOptions;
+
 using loadType = std::function<std::unique_ptr<Image>(std::istream&)>;
-using exportType = std::function<std::unique_ptr<Image>(std::unique_ptr<Image>&&, std::ostream&)>;
+// 書き出しに失敗したら nullptr を返す。
+using exportType = std::function<std::unique_ptr<Image>(std::unique_ptr<Image>&&, ByteSink&)>;
 using infoType = std::function<void(std::istream&)>;
-auto availableExts = make_array<std::tuple<std::string, loadType, exportType, infoType>>(
-  std::make_tuple("png", PNG::load, PNG::exportPNG, PNG::showInfo),
-  std::make_tuple("pnm", PNM::load, PNM::exportPNM, nullptr),
-  std::make_tuple("gif", GIF::load, GIF::exportGIF, GIF::showInfo),
-  std::make_tuple("jpg", nullptr, nullptr, JPG::showInfo)
+// ファイル名から直接読めるもの(メモリにマップして読むなど)。無ければ ifstream を開いて loadType で読む。
+using loadFileType = std::function<std::unique_ptr<Image>(std::string const&)>;
+auto availableExts = make_array<std::tuple<std::string, loadType, exportType, infoType, loadFileType>>(
+  std::make_tuple("png", PNG::load, [](std::unique_ptr<Image>&& img, ByteSink& os) { return PNG::exportPNG(std::move(img), os, pngOptions); }, PNG::showInfo, PNG::loadFile),
+  std::make_tuple("pnm", PNM::load, PNM::exportPNM, nullptr, nullptr),
+  std::make_tuple("gif", GIF::load, GIF::exportGIF, GIF::showInfo, nullptr),
+  std::make_tuple("jpg", nullptr, nullptr, JPG::showInfo, nullptr)
 );
 
 auto hasSuffix = [](std::string const& str, std::string const& suffix) {
@@ -55,17 +63,44 @@ FullColorIterator const FullColorIterator::end = FullColorIterator{true};
 std::unique_ptr<Image> testFullcolor() {
   size_t width{4096};
   size_t height{0x1000000 / width};
-  std::vector<Pixel> pixels(0x1000000);
+  Pixels pixels(0x1000000);
   copy(FullColorIterator{}, FullColorIterator::end, begin(pixels));
 
   return std::make_unique<Image>(width, height, pixels);
 }
 
+// 拡張子から読み方を決めて読む。読めなければ nullptr。
+std::unique_ptr<Image> loadImage(std::string const& in) {
+  for(auto e: availableExts) {
+    auto ext = std::get<0>(e);
+    auto load = std::get<1>(e);
+    auto loadFile = std::get<4>(e);
+    if(!hasSuffix(in, "." + ext)) {
+      continue;
+    }
+    if(loadFile != nullptr) {
+      return loadFile(in);
+    }
+    if(load != nullptr) {
+      std::ifstream fs{in, std::ifstream::binary};
+      if(!fs.is_open()) {
+        std::cerr << "failed to open " << in << std::endl;
+        return nullptr;
+      }
+      return load(fs);
+    }
+  }
+  return nullptr;
+}
+
 int main(int argc, char** argv) {
   std::unique_ptr<Image> img;
   if(argc < 2) {
     std::cerr << argv[0] << " show infile" << std::endl;
-    std::cerr << argv[0] << " convert infile outfile" << std::endl;
+    std::cerr << argv[0] << " convert infile outfile [stored|rle|fast|default|max|palette|strips|stream]" << std::endl;
+    std::cerr << argv[0] << " optimize infile.png outfile.png [budget(ms)]" << std::endl;
+    std::cerr << argv[0] << " frames infile.gif outfile" << std::endl;
+    std::cerr << argv[0] << " animate outfile.gif delay(1/100s) infiles..." << std::endl;
     return -1;
   }
   if(std::string{argv[1]} == "show") {
@@ -89,17 +124,148 @@ int main(int argc, char** argv) {
     return -1;
   }
 
+  if(std::string{argv[1]} == "optimize") {
+    if(argc < 4) {
+      std::cerr << argv[0] << " optimize infile.png outfile.png [budget(ms)]" << std::endl;
+      return -1;
+    }
+    std::string in{argv[2]}, out{argv[3]};
+    PNG::OptimizeOptions options;
+    if(argc > 4) {
+      options.budget = std::chrono::milliseconds{std::stol(argv[4])};
+    }
+    img = in == "png:-" ? PNG::load(std::cin) : PNG::loadFile(in);
+    if(!img) {
+      std::cerr << "something wrong while loading " << in << "." << std::endl;
+      return -1;
+    }
+    if(out == "png:-") {
+      FdSink sink{STDOUT_FILENO};
+      if(!PNG::optimize(*img, sink, options) || !sink.flush()) {
+        std::cerr << "failed to write to stdout" << std::endl;
+        return -1;
+      }
+      return 0;
+    }
+    FileSink sink{out};
+    if(!sink.good()) {
+      std::cerr << "failed to open " << out << std::endl;
+      return -1;
+    }
+    if(!PNG::optimize(*img, sink, options) || !sink.flush()) {
+      std::cerr << "failed to write " << out << std::endl;
+      return -1;
+    }
+    return 0;
+  }
+
+  if(std::string{argv[1]} == "frames") {
+    // アニメーション GIF の各フレームを合成して、outfile の拡張子の前に -0, -1, ... を付けた名前で書く。
+    if(argc < 4) {
+      std::cerr << argv[0] << " frames infile.gif outfile" << std::endl;
+      return -1;
+    }
+    std::string in{argv[2]}, out{argv[3]};
+    std::ifstream fs{in, std::ifstream::binary};
+    if(!fs.is_open()) {
+      std::cerr << "failed to open " << in << std::endl;
+      return -1;
+    }
+    auto animation = GIF::Animation::open(fs);
+    if(!animation) {
+      std::cerr << "something wrong while loading " << in << "." << std::endl;
+      return -1;
+    }
+    size_t const dot = out.rfind('.');
+    std::string const stem = out.substr(0, dot);
+    std::string const suffix = dot == std::string::npos ? "" : out.substr(dot);
+    exportType export_;
+    for(auto e: availableExts) {
+      if(suffix == "." + std::get<0>(e)) {
+        export_ = std::get<2>(e);
+      }
+    }
+    if(!export_) {
+      std::cerr << "output file " << out << " is not supported." << std::endl;
+      return -1;
+    }
+    size_t n{0};
+    for(auto it = animation->begin(); it != animation->end(); ++it, ++n) {
+      std::string const name = stem + "-" + std::to_string(n) + suffix;
+      FileSink sink{name};
+      if(!export_(std::make_unique<Image>(*it), sink)) {
+        std::cerr << "failed to encode " << name << std::endl;
+        return -1;
+      }
+      if(!sink.flush()) {
+        std::cerr << "failed to write " << name << std::endl;
+        return -1;
+      }
+    }
+    return 0;
+  }
+
+  if(std::string{argv[1]} == "animate") {
+    // 入力の画像を順にフレームにして、アニメーション GIF を書く。
+    if(argc < 5) {
+      std::cerr << argv[0] << " animate outfile.gif delay(1/100s) infiles..." << std::endl;
+      return -1;
+    }
+    std::string out{argv[2]};
+    int const delay = std::stoi(argv[3]);
+    FileSink sink{out};
+    if(!sink.good()) {
+      std::cerr << "failed to open " << out << std::endl;
+      return -1;
+    }
+    std::unique_ptr<GIF::AnimationWriter> writer;
+    for(int i{4}; i < argc; ++i) {
+      std::string in{argv[i]};
+      img = loadImage(in);
+      if(!img) {
+        std::cerr << "something wrong while loading " << in << "." << std::endl;
+        return -1;
+      }
+      if(!writer) {
+        writer = GIF::AnimationWriter::open(sink, img->width(), img->height());
+        if(!writer) {
+          return -1;
+        }
+      }
+      if(!writer->add(*img, delay)) {
+        std::cerr << "failed to add " << in << std::endl;
+        return -1;
+      }
+    }
+    if(!writer->finish() || !sink.flush()) {
+      std::cerr << "failed to write " << out << std::endl;
+      return -1;
+    }
+    return 0;
+  }
+
   if(std::string{argv[1]} == "convert") {
     std::string in{argv[2]}, out{argv[3]};
     bool okIn{false}, okOut{false};
+    if(argc > 4) {
+      auto options = PNG::preset(argv[4]);
+      if(!options) {
+        std::cerr << "unknown preset " << argv[4] << "." << std::endl;
+        return -1;
+      }
+      pngOptions = *options;
+    }
     if(in == "fullcolor:") {
       img = testFullcolor();
     }
     for(auto e: availableExts) {
       auto ext = std::get<0>(e);
       auto load = std::get<1>(e);
+      auto loadFile = std::get<4>(e);
       if(in == ext + ":-") {
         img = load(std::cin);
+      } else if(hasSuffix(in, "." + ext) && loadFile != nullptr) {
+        img = loadFile(in);
       } else if(hasSuffix(in, "." + ext)) {
         std::ifstream fs{in, std::ifstream::binary};
         if (!fs.is_open()) {
@@ -128,15 +294,30 @@ int main(int argc, char** argv) {
       auto ext = std::get<0>(e);
       auto export_ = std::get<2>(e);
       if(out == ext + ":-") {
-        export_(std::move(img), std::cout);
+        FdSink sink{STDOUT_FILENO};
+        if(!export_(std::move(img), sink)) {
+          std::cerr << "failed to encode " << ext << std::endl;
+          return -1;
+        }
+        if(!sink.flush()) {
+          std::cerr << "failed to write to stdout" << std::endl;
+          return -1;
+        }
         okOut = true;
       } else if (hasSuffix(out, "." + ext)) {
-        std::ofstream fs{out, std::ofstream::binary};
-        if (!fs.is_open()) {
+        FileSink sink{out};
+        if (!sink.good()) {
           std::cerr << "failed to open " << out << std::endl;
           return -1;
         }
-        export_(std::move(img), fs);
+        if(!export_(std::move(img), sink)) {
+          std::cerr << "failed to encode " << out << std::endl;
+          return -1;
+        }
+        if(!sink.flush()) {
+          std::cerr << "failed to write " << out << std::endl;
+          return -1;
+        }
         okOut = true;
       }
     }
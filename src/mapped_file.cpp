@@ -0,0 +1,31 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mapped_file.h"
+
+MappedFile::MappedFile(std::string const& path) : data_{nullptr}, size_{0} {
+  int const fd = open(path.c_str(), O_RDONLY);
+  if(fd < 0) {
+    return;
+  }
+  struct stat st;
+  // 通常のファイルで、中身がある時だけマップする。
+  if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(p != MAP_FAILED) {
+      madvise(p, st.st_size, MADV_SEQUENTIAL);
+      data_ = static_cast<Byte const*>(p);
+      size_ = st.st_size;
+    }
+  }
+  // マップした領域は fd を閉じても有効。
+  close(fd);
+}
+
+MappedFile::~MappedFile() {
+  if(data_ != nullptr) {
+    munmap(const_cast<Byte*>(data_), size_);
+  }
+}
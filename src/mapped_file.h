@@ -0,0 +1,21 @@
+#include <cstddef>
+#include <string>
+
+#include "byte.h"
+
+#pragma once
+
+// ファイル全体を読み込み専用でメモリにマップする。マップできなければ ok() が false になる。
+class MappedFile {
+public:
+  MappedFile(std::string const& path);
+  ~MappedFile();
+  MappedFile(MappedFile const&) = delete;
+  MappedFile& operator=(MappedFile const&) = delete;
+  bool ok() const { return data_ != nullptr; }
+  Byte const* data() const { return data_; }
+  size_t size() const { return size_; }
+private:
+  Byte const* data_;
+  size_t size_;
+};
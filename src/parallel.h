@@ -0,0 +1,33 @@
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+#pragma once
+
+// 0 から n - 1 までの i について fn(i) を呼ぶ。コア数ぶんのスレッドで早い者勝ちに取っていく。
+template<typename F>
+void parallelFor(size_t n, F&& fn) {
+  size_t const threads = std::min<size_t>(n, std::max(1u, std::thread::hardware_concurrency()));
+  if(threads <= 1) {
+    for(size_t i{0}; i < n; ++i) {
+      fn(i);
+    }
+    return;
+  }
+  std::atomic<size_t> next{0};
+  auto worker = [&]() {
+    for(size_t i; (i = next.fetch_add(1)) < n;) {
+      fn(i);
+    }
+  };
+  std::vector<std::thread> pool;
+  for(size_t t{1}; t < threads; ++t) {
+    pool.emplace_back(worker);
+  }
+  worker();
+  for(auto& th: pool) {
+    th.join();
+  }
+}
@@ -4,30 +4,53 @@
 #include <array>
 #include <cmath>
 #include <cstdint>
+#include <cstring>
 #include <cctype>
 #include <sstream>
 #include <algorithm>
 #include <variant>
+#include <span>
+#include <atomic>
+#include <chrono>
+#include <mutex>
 
 #include "png.h"
 #include "byte.h"
+#include "checksum.h"
+#include "color_table.h"
 #include "deflate.h"
+#include "filter.h"
+#include "mapped_file.h"
+#include "parallel.h"
+#include "quantize.h"
 #include "read.h"
+#include "sink.h"
 #include "to_string.h"
 
 using std::begin;
 using std::end;
 
 namespace PNG {
+  // チャンクの型は、ファイル上の 4 バイトを big endian の整数として読んだ値で持つ。
+  constexpr uint32_t fourcc(char const (&s)[5]) {
+    return (static_cast<uint32_t>(static_cast<Byte>(s[0])) << 24) | (static_cast<uint32_t>(static_cast<Byte>(s[1])) << 16)
+      | (static_cast<uint32_t>(static_cast<Byte>(s[2])) << 8) | static_cast<uint32_t>(static_cast<Byte>(s[3]));
+  }
+
+  std::string typeName(uint32_t type) {
+    return std::string{static_cast<char>(type >> 24), static_cast<char>(type >> 16), static_cast<char>(type >> 8), static_cast<char>(type)};
+  }
+
   class BaseChunk {
   public:
-    BaseChunk(std::string const& t) : type_{t} {}
-    std::string const& type() const { return type_; }
-    bool isCritical() { return std::isupper(type_[0]); }
-    bool isPublic() { return std::isupper(type_[1]); }
-    bool isSafe() { return std::isupper(type_[3]); }
+    BaseChunk(uint32_t t) : type_{t} {}
+    uint32_t type() const { return type_; }
+    // 各バイトの bit 5 が立っていなければ大文字。
+    bool isCritical() { return !(type_ & 0x20000000); }
+    bool isPublic() { return !(type_ & 0x00200000); }
+    bool isSafe() { return type_ & 0x00000020; }
   private:
-    std::string const type_;
+    uint32_t const type_;
   };
 
   class IHDRChunk {
@@ -49,7 +72,7 @@ namespace PNG {
       filter_{filter},
       interlace_{interlace}
     {}
-    std::string type() const { return type_; }
+    uint32_t type() const { return type_; }
     size_t width() const { return width_; }
     size_t height() const  { return height_; }
     Byte depth() const  { return depth_; }
@@ -57,8 +80,8 @@ namespace PNG {
     Byte compression() const  { return compression_; }
     Byte filter() const  { return filter_; }
     Byte interlace() const { return interlace_; }
+    inline static constexpr uint32_t type_ = fourcc("IHDR");
   private:
-    inline static std::string const type_ = "IHDR";
     size_t const width_;
     size_t const height_;
     Byte const depth_;
@@ -73,9 +96,9 @@ namespace PNG {
     IDATChunk(std::vector<Byte> const& data) : data_{data} {}
     IDATChunk(std::vector<Byte>&& data) : data_{std::move(data)} {}
     std::vector<Byte> const& data() const { return data_; }
-    std::string type() const { return type_; }
+    uint32_t type() const { return type_; }
+    inline static constexpr uint32_t type_ = fourcc("IDAT");
   private:
-    inline static std::string const type_ = "IDAT";
     std::vector<Byte> const data_;
   };
 
@@ -83,38 +106,47 @@ namespace PNG {
   public:
     iTXtChunk(std::string_view t) : text_{t} {}
     std::string text() { return text_; }
-    std::string type() const { return type_; }
-    std::string show() const { return type_ + ": " + text_; }
+    uint32_t type() const { return type_; }
+    std::string show() const { return typeName(type_) + ": " + text_; }
+    inline static constexpr uint32_t type_ = fourcc("iTXt");
   private:
-    inline static std::string const type_ = "iTXt";
     std::string const text_;
   };
 
-  using Chunk = std::variant<BaseChunk, IHDRChunk, IDATChunk, iTXtChunk>;
+  class PLTEChunk {
+  public:
+    PLTEChunk(std::vector<Pixel>&& palette) : palette_{std::move(palette)} {}
+    std::vector<Pixel> const& palette() const { return palette_; }
+    uint32_t type() const { return type_; }
+    std::string show() const { return typeName(type_) + ": " + std::to_string(palette_.size()) + " colors"; }
+    inline static constexpr uint32_t type_ = fourcc("PLTE");
+  private:
+    std::vector<Pixel> const palette_;
+  };
 
-  constexpr std::array<uint32_t, 256> makeCrcTable() {
-    std::array<uint32_t, 256> table{};
-    for(int i{0}; i < 256; ++i) {
-      uint32_t c{static_cast<uint32_t>(i)};
-      for(int j{0}; j < 8; ++j){
-        if(c & 1) {
-          c = UINT32_C(0xedb88320) ^ (c >> 1);
-        } else {
-          c >>= 1;
-        }
-      }
-      table[i] = c;
-    }
-    return table;
-  }
-  std::array<uint32_t, 256> constexpr const crcTable = makeCrcTable();
+  // 独自の補助チャンク。IDAT の zlib 列のうち full flush した位置と、そこから始まる行の一覧。
+  // 各位置から先は前の辞書に依存しないので、区間ごとに別々に伸長できる。
+  // IDAT を読み始める前に知る必要があるので、最初の IDAT より前に置く。IDAT より後ろのものは使わない。
+  class stRPChunk {
+  public:
+    struct Restart {
+      size_t row;
+      size_t offset;
+    };
+    stRPChunk(std::vector<Restart>&& restarts) : restarts_{std::move(restarts)} {}
+    std::vector<Restart> const& restarts() const { return restarts_; }
+    uint32_t type() const { return type_; }
+    std::string show() const { return typeName(type_) + ": " + std::to_string(restarts_.size()) + " restart points"; }
+    inline static constexpr uint32_t type_ = fourcc("stRP");
+  private:
+    std::vector<Restart> const restarts_;
+  };
 
-  std::array<Byte, 4> crc(std::vector<Byte> const& data) {
-    uint32_t crc_ = UINT32_C(0xffffffff);
-    for(auto b: data) {
-      crc_ = crcTable[(crc_ ^ b) & 0xff] ^ (crc_ >> 8);
-    }
-    crc_ = ~crc_;
+  constexpr uint32_t IEND = fourcc("IEND");
+
+  using Chunk = std::variant<BaseChunk, IHDRChunk, IDATChunk, iTXtChunk, PLTEChunk, stRPChunk>;
+
+  std::array<Byte, 4> crcBytes(uint32_t crc_) {
     std::array<Byte, 4> c{};
     c[3] = crc_ & 0xff;
     c[2] = (crc_ & 0xff00) >> 8;
@@ -123,48 +155,178 @@ namespace PNG {
     return c;
   }
 
-  Pixel average(Pixel lhs, Pixel rhs) {
-    auto ave = [](Byte a, Byte b) -> Byte { return (static_cast<int>(a) + b) / 2; };
-    Pixel p;
-    p.r = ave(lhs.r, rhs.r);
-    p.g = ave(lhs.g, rhs.g);
-    p.b = ave(lhs.b, rhs.b);
-    return p;
+  std::array<Byte, 4> crc(std::vector<Byte> const& data) {
+    return crcBytes(Checksum::crc32(0, data.data(), data.size()));
   }
 
-  Pixel paethPredictor(Pixel a, Pixel b, Pixel c) {
-    auto pp = [](Byte a, Byte b, Byte c) {
-      int pp = static_cast<int>(a) + b - c;
-      int pa = std::abs(pp - a);
-      int pb = std::abs(pp - b);
-      int pc = std::abs(pp - c);
+  std::array<Byte, 8> const pngSigneture = { 0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a };
+
+  // チャンクの中身の位置(ファイル先頭から)と長さと型。中身そのものは読み元に置いたまま。
+  struct ChunkView {
+    size_t offset;
+    uint32_t length;
+    uint32_t type;
+  };
+
+  // チャンクを先頭から順に読む。next() で次のチャンクの ChunkView を得て、
+  // その中身を payload() でまとめて、または piece() で断片ごとに受け取る。どちらも最後に CRC を確かめる。
+  class ChunkReader {
+  public:
+    virtual ~ChunkReader() = default;
+    virtual bool signature() = 0;
+    virtual bool good() const = 0;
+    virtual ChunkView next() = 0;
+    virtual std::span<Byte const> payload(ChunkView const& view) = 0;
+    // 中身の続きを data, size に返す。中身を読み終えたら false。
+    virtual bool piece(ChunkView const& view, Byte const*& data, size_t& size) = 0;
+    // piece が返した領域が、次を読んだ後も読み元に残っていれば true。
+    virtual bool inPlace() const { return false; }
 
-      if (pa <= pb && pa <= pc) {
-        return a;
-      } else if (pb <= pc) {
-        return b;
-      } else {
-        return c;
+  protected:
+    void check(ChunkView const& view, uint32_t crc, Byte const* expected) {
+      std::array<Byte, 4> const actual = crcBytes(crc);
+      if(!std::equal(begin(actual), end(actual), expected)) {
+        std::array<Byte, 4> e;
+        std::copy_n(expected, 4, begin(e));
+        std::cerr << "crc mismatched at " << typeName(view.type) << " chunk(expected " << to_str(actual) << ", but got " << to_str(e) << ")." << std::endl;
       }
-    };
-    Pixel p;
-    p.r = pp(a.r, b.r, c.r);
-    p.g = pp(a.g, b.g, c.g);
-    p.b = pp(a.b, b.b, c.b);
-    return p;
+    }
+    uint32_t typeCrc(uint32_t type) {
+      std::array<Byte, 4> const t{static_cast<Byte>(type >> 24), static_cast<Byte>(type >> 16), static_cast<Byte>(type >> 8), static_cast<Byte>(type)};
+      return Checksum::crc32(0, t.data(), t.size());
+    }
   };
 
-  std::array<Byte, 8> const pngSigneture = { 0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a };
+  // istream から読む。中身は使い回すバッファに写す。IDAT は固定長ずつ読むのでチャンクが大きくてもメモリは増えない。
+  class StreamChunkReader : public ChunkReader {
+  public:
+    StreamChunkReader(std::istream& fs) : fs_{fs}, pos_{0}, remaining_{0}, crc_{0} {}
 
-  bool readHeader(std::istream& fs) {
-    auto const sig = read<std::array<Byte, 8>>(fs);
-    for(int i{0}; i < 8; ++i) {
-      if(sig[i] != pngSigneture[i]) { return false; }
+    bool signature() override {
+      auto const sig = read<std::array<Byte, 8>>(fs_);
+      pos_ += sig.size();
+      return fs_ && sig == pngSigneture;
     }
-    return true;
-  }
 
-  std::unique_ptr<Chunk> readIHDR(std::vector<Byte>::const_iterator& it) {
+    bool good() const override { return static_cast<bool>(fs_); }
+
+    ChunkView next() override {
+      uint32_t const length = readSize(fs_);
+      uint32_t const type = readSize(fs_);
+      pos_ += 8;
+      remaining_ = length;
+      crc_ = typeCrc(type);
+      return ChunkView{pos_, length, type};
+    }
+
+    std::span<Byte const> payload(ChunkView const& view) override {
+      buf_.resize(remaining_);
+      fs_.read(reinterpret_cast<char*>(buf_.data()), buf_.size());
+      consume(buf_.data(), buf_.size());
+      finish(view);
+      return buf_;
+    }
+
+    bool piece(ChunkView const& view, Byte const*& data, size_t& size) override {
+      if(remaining_ == 0) {
+        finish(view);
+        return false;
+      }
+      size_t const n = std::min(remaining_, pieceSize);
+      buf_.resize(n);
+      fs_.read(reinterpret_cast<char*>(buf_.data()), n);
+      if(!fs_) {
+        return false;
+      }
+      consume(buf_.data(), n);
+      data = buf_.data();
+      size = n;
+      return true;
+    }
+
+  private:
+    inline static size_t const pieceSize{1 << 16};
+
+    void consume(Byte const* data, size_t size) {
+      crc_ = Checksum::crc32(crc_, data, size);
+      remaining_ -= size;
+      pos_ += size;
+    }
+
+    void finish(ChunkView const& view) {
+      auto const crc = read<std::array<Byte, 4>>(fs_);
+      pos_ += crc.size();
+      check(view, crc_, crc.data());
+    }
+
+    std::istream& fs_;
+    std::vector<Byte> buf_;
+    size_t pos_;
+    size_t remaining_;
+    uint32_t crc_;
+  };
+
+  // メモリに載っている(マップした)ファイルを読む。中身は写さずにその場所を返す。
+  class MappedChunkReader : public ChunkReader {
+  public:
+    MappedChunkReader(Byte const* data, size_t size) : data_{data}, size_{size}, pos_{0}, good_{true}, done_{false} {}
+
+    bool signature() override {
+      good_ = size_ >= pngSigneture.size() && std::equal(begin(pngSigneture), end(pngSigneture), data_);
+      pos_ = pngSigneture.size();
+      return good_;
+    }
+
+    bool good() const override { return good_; }
+
+    ChunkView next() override {
+      if(!good_ || pos_ + 8 > size_) {
+        good_ = false;
+        return ChunkView{pos_, 0, 0};
+      }
+      Byte const* p = data_ + pos_;
+      uint32_t const length = readSize(p);
+      uint32_t const type = readSize(p);
+      ChunkView const view{pos_ + 8, length, type};
+      if(view.offset + length + 4 > size_) {
+        std::cerr << typeName(type) << " chunk is truncated" << std::endl;
+        good_ = false;
+        return ChunkView{pos_, 0, 0};
+      }
+      pos_ = view.offset + length + 4;
+      done_ = false;
+      return view;
+    }
+
+    std::span<Byte const> payload(ChunkView const& view) override {
+      Byte const* p = data_ + view.offset;
+      check(view, Checksum::crc32(typeCrc(view.type), p, view.length), p + view.length);
+      return std::span<Byte const>{p, view.length};
+    }
+
+    // 中身は全部まとめて1つの断片として返す。
+    bool piece(ChunkView const& view, Byte const*& data, size_t& size) override {
+      if(done_) {
+        return false;
+      }
+      done_ = true;
+      auto const p = payload(view);
+      data = p.data();
+      size = p.size();
+      return size != 0;
+    }
+
+    bool inPlace() const override { return true; }
+
+  private:
+    Byte const* data_;
+    size_t size_;
+    size_t pos_;
+    bool good_;
+    bool done_;
+  };
+
+  std::unique_ptr<Chunk> readIHDR(Byte const*& it) {
     size_t width = readSize(it);
     size_t height = readSize(it);
     auto const others = read<std::array<Byte,5>>(it);
@@ -181,292 +343,845 @@ namespace PNG {
     );
   }
 
-  std::unique_ptr<Chunk> readIDAT(std::vector<Byte>::const_iterator& it, size_t size) {
-    auto const data = read<std::vector<Byte>>(it, size);
-    return std::make_unique<Chunk>(std::move(data));
+  std::unique_ptr<Chunk> readIDAT(Byte const*& it, size_t size) {
+    auto data = read<std::vector<Byte>>(it, size);
+    return std::make_unique<Chunk>(IDATChunk{std::move(data)});
+  }
+
+  std::unique_ptr<Chunk> readPLTE(Byte const*& it, size_t size) {
+    std::vector<Pixel> palette(size / 3);
+    for(auto& p: palette) {
+      p = read<Pixel>(it);
+    }
+    return std::make_unique<Chunk>(PLTEChunk{std::move(palette)});
   }
 
-  std::unique_ptr<Chunk> readiTXt(std::vector<Byte>::const_iterator& it, size_t size) {
+  std::unique_ptr<Chunk> readstRP(Byte const*& it, size_t size) {
+    std::vector<stRPChunk::Restart> restarts(size / 8);
+    for(auto& r: restarts) {
+      r.row = readSize(it);
+      r.offset = readSize(it);
+    }
+    return std::make_unique<Chunk>(stRPChunk{std::move(restarts)});
+  }
+
+  std::unique_ptr<Chunk> readiTXt(Byte const*& it, size_t size) {
     return std::make_unique<Chunk>(
       iTXtChunk{std::string{it, it + size}}
     );
   }
 
-  std::unique_ptr<Chunk> readChunk(std::istream& fs) {
-    size_t const size = readSize(fs);
-    // 4 is type
-    std::vector<Byte> const buf = read<std::vector<Byte>>(fs, size + 4);
-    auto it = begin(buf);
-    auto const types = read<std::array<char, 4>>(it);
-    std::string const type{begin(types), end(types)};
-    std::unique_ptr<Chunk> chunk;
-    if(type == "IHDR") {
-      chunk = readIHDR(it);
-    } else if(type == "IDAT") {
-      chunk = readIDAT(it, size);
-    } else if(type == "IEND") {
-      chunk = std::make_unique<Chunk>(BaseChunk{"IEND"});
-    } else if(type == "iTXt") {
-      chunk = readiTXt(it, size);
-    } else {
-      std::cerr << "unknown chunk type: " << type << std::endl;
-      std::cerr << "size: " << size << std::endl;
-      chunk = std::make_unique<Chunk>(type);
+  std::unique_ptr<Chunk> readChunkBody(ChunkReader& reader, ChunkView const& view) {
+    auto const data = reader.payload(view);
+    Byte const* it = data.data();
+    size_t const size = data.size();
+    if(size < view.length) {
+      return std::make_unique<Chunk>(BaseChunk{view.type});
     }
-    auto const crc_ = read<std::array<Byte, 4>>(fs);
-    std::array<Byte, 4> expected = crc(buf);
-    if(crc_ != expected) {
-      std::cerr << "crc mismatched at IEND chunk(expected " << to_str(expected) << ", but got " << to_str(crc_) << ")." << std::endl;
+    switch(view.type) {
+    case IHDRChunk::type_:
+      return readIHDR(it);
+    case IDATChunk::type_:
+      return readIDAT(it, size);
+    case IEND:
+      return std::make_unique<Chunk>(BaseChunk{IEND});
+    case PLTEChunk::type_:
+      return readPLTE(it, size);
+    case iTXtChunk::type_:
+      return readiTXt(it, size);
+    case stRPChunk::type_:
+      return readstRP(it, size);
+    default:
+      std::cerr << "unknown chunk type: " << typeName(view.type) << std::endl;
+      std::cerr << "size: " << size << std::endl;
+      return std::make_unique<Chunk>(BaseChunk{view.type});
     }
-    return chunk;
   }
 
-  std::string type(Chunk const& c) {
-    return std::visit([](auto const& arg) -> std::string { return arg.type(); }, c);
+  std::unique_ptr<Chunk> readChunk(ChunkReader& reader) {
+    return readChunkBody(reader, reader.next());
   }
 
-  std::vector<std::unique_ptr<Chunk>> readChunks(std::istream& fs) {
+  uint32_t type(Chunk const& c) {
+    return std::visit([](auto const& arg) -> uint32_t { return arg.type(); }, c);
+  }
+
+  std::vector<std::unique_ptr<Chunk>> readChunks(ChunkReader& reader) {
     std::vector<std::unique_ptr<Chunk>> v;
     std::unique_ptr<Chunk> c;
-    std::string type;
+    uint32_t type;
     do {
-      c = readChunk(fs);
+      c = readChunk(reader);
       type = PNG::type(*c);
-      std::cerr << type << std::endl;
+      std::cerr << typeName(type) << std::endl;
       v.push_back(std::move(c));
-    } while(type != "IEND");
+    } while(type != IEND && reader.good());
     return v;
   }
 
-  std::vector<Byte> concatIDAT(std::vector<std::unique_ptr<Chunk>>& cs) {
-    std::vector<Byte> v;
-    for(auto& c : cs) {
-      if(PNG::type(*c) == "IDAT") {
-        auto& ic = std::get<IDATChunk>(*c);
-        std::vector<Byte> const& d = ic.data();
-        v.insert(end(v), begin(d), end(d));
+  // IDAT チャンクを断片ずつ読みながら伸長する。
+  // チャンク境界をまたいで Inflater に流し込むので、ファイル全体も IDAT 全体もメモリに写さない。
+  class IDATStream {
+  public:
+    IDATStream(ChunkReader& reader) : reader_{reader}, inIDAT_{false}, ended_{false} {}
+
+    // 最初の IDAT の手前までのチャンクを読んで chunks に積む。
+    bool start(std::vector<std::unique_ptr<Chunk>>& chunks) {
+      while(reader_.good()) {
+        ChunkView const view = reader_.next();
+        if(!reader_.good()) {
+          break;
+        }
+        if(view.type == IDATChunk::type_) {
+          current_ = view;
+          inIDAT_ = true;
+          return true;
+        }
+        auto c = readChunkBody(reader_, view);
+        std::cerr << typeName(view.type) << std::endl;
+        chunks.push_back(std::move(c));
+        if(view.type == IEND) {
+          break;
+        }
       }
+      std::cerr << "IDAT chunk not found" << std::endl;
+      return false;
     }
-    return v;
-  }
 
-  std::vector<Pixel> render(IHDRChunk const& ihdr, std::vector<Byte>& data) {
-    size_t const width = ihdr.width();
-    size_t const height = ihdr.height();
-    int const depth = ihdr.depth();
-    int const colorType = ihdr.colorType();
-    int const filter = ihdr.filter();
-    std::vector<Pixel> pixels(width * height);
-    for(size_t h{0}; h < height; ++h) {
-      for(size_t w{0}; w < width; ++w) {
-        int i = h * width + w;
-        Pixel p;
-        switch(colorType) {
-        case 0: // grayscale
-        {
-          switch(filter) {
-          case 0: // None
-            if(depth == 1) {
-              p.r = p.g = p.b = data[h * (width + 1) + w + 1] ? 255 : 0;
-            } else {
-              p.r = p.g = p.b = data[h * (width + 1) + w + 1];
-            }
-          }
-          break;
+    // ちょうど size バイトを伸長して dst に書く。
+    bool read(Byte* dst, size_t size) {
+      size_t got{0};
+      while(got < size) {
+        size_t const n = inflater_.inflate(dst + got, size - got);
+        got += n;
+        if(inflater_.failed()) {
+          std::cerr << "inflate failed (broken data or adler-32 mismatch)" << std::endl;
+          return false;
         }
-        case 2: // color
-        {
-          int base = h * (width * 3 + 1) + w * 3 + 1;
-          p = {data[base], data[base + 1], data[base + 2]};
-          switch(data[h * (width * 3 + 1)]) { // filtertype
-          case 0: // None
-          {
-            break;
-          }
-          case 1: // Sub
-          {
-            Pixel b{};
-            if(w != 0) {
-              b = pixels[i - 1];
-            }
-            p = p + b;
-            break;
-          }
-          case 2: // Up
-          {
-            Pixel b{};
-            if(h != 0) {
-              b = pixels[i - width];
-            }
-            p = p + b;
-            break;
-          }
-          case 3: // Ave
-          {
-            Pixel b1{}, b2{};
-            if(w != 0) {
-              b1 = pixels[i - 1];
-            }
-            if(h != 0) {
-              b2 = pixels[i - width];
-            }
-            p = p + average(b1, b2);
-            break;
-          }
-          case 4: // Paeth
-          {
-            Pixel left{};
-            Pixel up{};
-            Pixel naname{};
-            if(w != 0) {
-              left = pixels[i - 1];
-            }
-            if(h != 0) {
-              up = pixels[i - width];
-            }
-            if(w != 0 && h != 0) {
-              naname = pixels[i - width - 1];
-            }
-            p = p + paethPredictor(left, up, naname);
+        if(n != 0) {
+          continue;
+        }
+        if(inflater_.finished() || !inflater_.needsInput() || !fill()) {
+          std::cerr << "image data is too short" << std::endl;
+          return false;
+        }
+      }
+      return true;
+    }
+
+    // 行を読み終えた後に呼ぶ。zlib 列の終わりまで伸長して Adler-32 を確かめる。余った分は捨てる。
+    bool verify() {
+      std::array<Byte, 256> rest;
+      while(!inflater_.finished()) {
+        size_t const n = inflater_.inflate(rest.data(), rest.size());
+        if(inflater_.failed()) {
+          std::cerr << "inflate failed (broken data or adler-32 mismatch)" << std::endl;
+          return false;
+        }
+        if(n == 0 && !inflater_.finished() && (!inflater_.needsInput() || !fill())) {
+          std::cerr << "image data is truncated" << std::endl;
+          return false;
+        }
+      }
+      return true;
+    }
+
+    // 伸長せずに残りの IDAT を全部読む。
+    std::vector<Byte> readAll() {
+      std::vector<Byte> v;
+      Byte const* data;
+      size_t size;
+      while(next(data, size)) {
+        v.insert(end(v), data, data + size);
+      }
+      return v;
+    }
+
+    // IDAT が1つだけなら、写さずにその中身を返して IDAT を読み終える。読み元の inPlace() が true の時だけ使う。
+    // 2つ以上なら空を返す。読んだ2つは Inflater に順に渡すので、続きは read で伸長する。
+    std::span<Byte const> single() {
+      Byte const* data;
+      size_t size;
+      if(!next(data, size)) {
+        return {};
+      }
+      Byte const* second;
+      size_t secondSize;
+      if(!next(second, secondSize)) {
+        return std::span<Byte const>{data, size};
+      }
+      inflater_.feed(data, size);
+      pending_ = std::span<Byte const>{second, secondSize};
+      return {};
+    }
+
+    // 残りの IDAT を読み捨て、後続のチャンクを IEND まで読む。
+    void finish() {
+      Byte const* data;
+      size_t size;
+      while(next(data, size)) {}
+      ChunkView view = current_;
+      while(reader_.good()) {
+        readChunkBody(reader_, view);
+        std::cerr << typeName(view.type) << std::endl;
+        if(view.type == IEND) {
+          return;
+        }
+        view = reader_.next();
+      }
+    }
+
+  private:
+    // 次の IDAT の断片を Inflater に渡す。IDAT が尽きたら false。
+    bool fill() {
+      if(!pending_.empty()) {
+        inflater_.feed(pending_.data(), pending_.size());
+        pending_ = {};
+        return true;
+      }
+      Byte const* data;
+      size_t size;
+      if(!next(data, size)) {
+        return false;
+      }
+      inflater_.feed(data, size);
+      return true;
+    }
+
+    // 次の IDAT の断片を読む。IDAT が尽きたら false で、current_ はその次のチャンクになる。
+    bool next(Byte const*& data, size_t& size) {
+      while(!ended_) {
+        if(!inIDAT_) {
+          current_ = reader_.next();
+          if(!reader_.good() || current_.type != IDATChunk::type_) {
+            ended_ = true;
             break;
           }
+          inIDAT_ = true;
+        }
+        if(reader_.piece(current_, data, size)) {
+          return true;
+        }
+        inIDAT_ = false;
+      }
+      return false;
+    }
+
+    ChunkReader& reader_;
+    Deflate::Inflater inflater_;
+    // single() が先に読んだ2つ目の IDAT。
+    std::span<Byte const> pending_;
+    ChunkView current_;
+    bool inIDAT_;
+    bool ended_;
+  };
+
+  size_t channels(Byte colorType) {
+    switch(colorType) {
+    case 0: return 1; // grayscale
+    case 2: return 3; // color
+    case 3: return 1; // palette
+    case 4: return 2; // grayscale + alpha
+    case 6: return 4; // color + alpha
+    default: return 0;
+    }
+  }
+
+  // 1行のバイト数(フィルタタイプを含まない)。
+  size_t stride(IHDRChunk const& ihdr) {
+    return (ihdr.width() * channels(ihdr.colorType()) * ihdr.depth() + 7) / 8;
+  }
+
+  // インターレースの縮小画像1枚分。(x0, y0) から (dx, dy) おきの画素を持つ。
+  struct Pass {
+    size_t x0, y0, dx, dy;
+    size_t width(size_t w) const { return (w + dx - 1 - x0) / dx; }
+    size_t height(size_t h) const { return (h + dy - 1 - y0) / dy; }
+  };
+  std::array<Pass, 7> constexpr const adam7 = {{
+    {0, 0, 8, 8}, {4, 0, 8, 8}, {0, 4, 4, 8}, {2, 0, 4, 4}, {0, 2, 2, 4}, {1, 0, 2, 2}, {0, 1, 1, 2},
+  }};
+  std::array<Pass, 1> constexpr const noInterlace = {{{0, 0, 1, 1}}};
+
+  std::span<Pass const> passes(IHDRChunk const& ihdr) {
+    if(ihdr.interlace() == 1) {
+      return adam7;
+    }
+    return noInterlace;
+  }
+
+  // IHDR から求めたフィルタ済みデータ(各行先頭のフィルタタイプ込み)のバイト数。
+  size_t rawSize(IHDRChunk const& ihdr) {
+    size_t const bits = channels(ihdr.colorType()) * ihdr.depth();
+    size_t size{0};
+    for(auto const& pass: passes(ihdr)) {
+      size_t const w = pass.width(ihdr.width());
+      size_t const h = pass.height(ihdr.height());
+      if(w != 0) {
+        size += ((w * bits + 7) / 8 + 1) * h;
+      }
+    }
+    return size;
+  }
+
+  // フィルタを戻した1行を Pixel に展開する。(ColorType, Depth) ごとに生成し、画像ごとに一度だけ選ぶ。
+  // Image は RGB だけなので、アルファは捨て、16bit は上位バイトを使う。
+  using ExpandFunc = void (*)(Byte const* row, Pixel* out, size_t width, Pixel const* palette);
+
+  template<int ColorType, int Depth>
+  void expandRow(Byte const* row, Pixel* out, size_t width, Pixel const* palette) {
+    if constexpr(Depth < 8) {
+      // 1バイトに 8 / Depth 画素が上位ビットから詰まっている。
+      constexpr int perByte = 8 / Depth;
+      constexpr Byte mask = (1 << Depth) - 1;
+      for(size_t w{0}; w < width; ++row) {
+        Byte b = *row;
+        for(int k{0}; k < perByte && w < width; ++k, ++w) {
+          Byte const v = (b >> (8 - Depth)) & mask;
+          b <<= Depth;
+          if constexpr(ColorType == 3) {
+            out[w] = palette[v];
+          } else {
+            Byte const g = v * (255 / mask);
+            out[w] = Pixel{g, g, g};
           }
         }
-        pixels[i] = p;
+      }
+    } else {
+      constexpr size_t step = Depth / 8;
+      constexpr size_t size = (ColorType == 0 || ColorType == 3) ? 1 : ColorType == 4 ? 2 : ColorType == 2 ? 3 : 4;
+      for(size_t w{0}; w < width; ++w, row += size * step) {
+        if constexpr(ColorType == 0 || ColorType == 4) {
+          out[w] = Pixel{row[0], row[0], row[0]};
+        } else if constexpr(ColorType == 3) {
+          out[w] = palette[row[0]];
+        } else {
+          out[w] = Pixel{row[0], row[step], row[2 * step]};
         }
       }
     }
-    return pixels;
   }
 
-  std::unique_ptr<Image> load(std::istream& fs) {
-    if(!readHeader(fs)) {
+  ExpandFunc expander(Byte colorType, Byte depth) {
+    switch(colorType) {
+    case 0:
+      switch(depth) {
+      case 1: return expandRow<0, 1>;
+      case 2: return expandRow<0, 2>;
+      case 4: return expandRow<0, 4>;
+      case 8: return expandRow<0, 8>;
+      case 16: return expandRow<0, 16>;
+      }
+      break;
+    case 2:
+      switch(depth) {
+      case 8: return expandRow<2, 8>;
+      case 16: return expandRow<2, 16>;
+      }
+      break;
+    case 3:
+      switch(depth) {
+      case 1: return expandRow<3, 1>;
+      case 2: return expandRow<3, 2>;
+      case 4: return expandRow<3, 4>;
+      case 8: return expandRow<3, 8>;
+      }
+      break;
+    case 4:
+      switch(depth) {
+      case 8: return expandRow<4, 8>;
+      case 16: return expandRow<4, 16>;
+      }
+      break;
+    case 6:
+      switch(depth) {
+      case 8: return expandRow<6, 8>;
+      case 16: return expandRow<6, 16>;
+      }
+      break;
+    }
+    return nullptr;
+  }
+
+  // フィルタ済みの行 first から last - 1 までを戻して展開する。raw は行ごとに先頭がフィルタタイプ。
+  bool unfilterRows(Byte* raw, size_t first, size_t last, size_t stride, Filter::Unfilters const& unfilters,
+                    ExpandFunc expand, Pixel const* palette, Pixel* pixels, size_t width) {
+    std::vector<Byte> const zero(stride);
+    Byte const* prev = first == 0 ? zero.data() : raw + (first - 1) * (stride + 1) + 1;
+    for(size_t y{first}; y < last; ++y) {
+      Byte* const row = raw + y * (stride + 1);
+      if(row[0] >= unfilters.size()) {
+        std::cerr << "unknown filter type: " << static_cast<int>(row[0]) << std::endl;
+        return false;
+      }
+      unfilters[row[0]](row + 1, prev, stride);
+      expand(row + 1, pixels + y * width, width, palette);
+      prev = row + 1;
+    }
+    return true;
+  }
+
+  // stRP の再開位置で区切った帯ごとに、伸長と逆フィルタをスレッドに分けて行う。
+  // 伸長に失敗したら全体を1本として伸長し直す。帯の先頭行が上の行を参照するフィルタなら逆フィルタは順に行う。
+  std::unique_ptr<Image> decodeStrips(IHDRChunk const& ihdr, stRPChunk const& strp, std::vector<Byte> const& data,
+                                      ExpandFunc expand, Pixel const* palette, size_t bpp) {
+    size_t const width = ihdr.width();
+    size_t const height = ihdr.height();
+    size_t const stride = PNG::stride(ihdr);
+    size_t const rowSize = stride + 1;
+
+    // 先頭の帯は zlib ヘッダ(2バイト)の直後から。
+    std::vector<stRPChunk::Restart> strips{{0, 2}};
+    for(auto const& r: strp.restarts()) {
+      if(r.row <= strips.back().row || r.row >= height || r.offset <= strips.back().offset || r.offset >= data.size()) {
+        std::cerr << "broken stRP chunk, decoding serially" << std::endl;
+        strips.resize(1);
+        break;
+      }
+      strips.push_back(r);
+    }
+    strips.push_back({height, data.size()});
+    size_t const count = strips.size() - 1;
+
+    auto raw = std::make_unique_for_overwrite<Byte[]>(rowSize * height);
+    std::vector<char> ok(count);
+    std::vector<uint32_t> adlers(count);
+    parallelFor(count, [&](size_t i) {
+      auto const& s = strips[i];
+      auto const& e = strips[i + 1];
+      ok[i] = Deflate::decompressRaw(data.data() + s.offset, e.offset - s.offset, raw.get() + s.row * rowSize, (e.row - s.row) * rowSize, i + 1 == count);
+      adlers[i] = Checksum::adler32(1, raw.get() + s.row * rowSize, (e.row - s.row) * rowSize);
+    });
+    // 帯ごとの Adler-32 をつないで、列の末尾の値と比べる。
+    uint32_t adler{adlers[0]};
+    for(size_t i{1}; i < count; ++i) {
+      adler = Checksum::adler32Combine(adler, adlers[i], (strips[i + 1].row - strips[i].row) * rowSize);
+    }
+    Byte const* trailer = data.data() + data.size() - 4;
+    if(data.size() < 6 || static_cast<uint32_t>(readSize(trailer)) != adler) {
+      ok[0] = false;
+    }
+    if(std::find(begin(ok), end(ok), false) != end(ok)) {
+      std::cerr << "strips are not independent, decoding serially" << std::endl;
+      if(!Deflate::decompress(data.data(), data.size(), raw.get(), rowSize * height)) {
+        std::cerr << "inflate failed" << std::endl;
+        return nullptr;
+      }
+    }
+
+    auto const unfilters = Filter::unfilters(bpp);
+    Pixels pixels(width * height);
+    bool const independent = all_of(begin(strips) + 1, end(strips) - 1, [&](auto const& s) { return raw[s.row * rowSize] <= 1; });
+    if(!independent) {
+      if(!unfilterRows(raw.get(), 0, height, stride, unfilters, expand, palette, pixels.data(), width)) {
+        return nullptr;
+      }
+    } else {
+      parallelFor(count, [&](size_t i) {
+        ok[i] = unfilterRows(raw.get(), strips[i].row, strips[i + 1].row, stride, unfilters, expand, palette, pixels.data(), width);
+      });
+      if(std::find(begin(ok), end(ok), false) != end(ok)) {
+        return nullptr;
+      }
+    }
+    return std::make_unique<Image>(width, height, std::move(pixels));
+  }
+
+  std::unique_ptr<Image> decode(ChunkReader& reader, PassCallback const& onPass) {
+    if(!reader.signature()) {
       std::cerr << "not png file" << std::endl;
       return nullptr;
     }
 
-    std::vector<std::unique_ptr<Chunk>> chunks = readChunks(fs);
-    auto const& ihdr = std::get<IHDRChunk>(*(chunks[0]));
-    size_t width = ihdr.width();
-    size_t height = ihdr.height();
-   std::cerr
-      << ihdr.depth() << ' '
-      << ihdr.colorType() << ' '
-      << ihdr.compression() << ' '
-      << ihdr.filter() << ' '
-      << ihdr.interlace() << std::endl;
-    std::vector<Byte> data = concatIDAT(chunks);
-    data = Deflate::decompress(data);
-// //    std::cout << "size: " << data.size() << std::endl;
-    // for(auto e: data) {
-    //   std::cout << int(e) << ' ';
-    // }
-    // std::cout << std::endl;
-    std::vector<Pixel> pixels = render(ihdr, data);
+    std::unique_ptr<Chunk> first = readChunk(reader);
+    if(!reader.good() || PNG::type(*first) != IHDRChunk::type_) {
+      std::cerr << "IHDR chunk not found" << std::endl;
+      return nullptr;
+    }
+    std::cerr << "IHDR" << std::endl;
+    auto const& ihdr = std::get<IHDRChunk>(*first);
+    size_t const width = ihdr.width();
+    size_t const height = ihdr.height();
+    std::cerr
+      << static_cast<int>(ihdr.depth()) << ' '
+      << static_cast<int>(ihdr.colorType()) << ' '
+      << static_cast<int>(ihdr.compression()) << ' '
+      << static_cast<int>(ihdr.filter()) << ' '
+      << static_cast<int>(ihdr.interlace()) << std::endl;
+    ExpandFunc const expand = expander(ihdr.colorType(), ihdr.depth());
+    if(expand == nullptr) {
+      std::cerr << "unsupported color type or depth" << std::endl;
+      return nullptr;
+    }
+    size_t const bpp = std::max<size_t>(1, channels(ihdr.colorType()) * ihdr.depth() / 8);
+    size_t const stride = PNG::stride(ihdr);
+
+    IDATStream idat{reader};
+    std::vector<std::unique_ptr<Chunk>> chunks;
+    if(!idat.start(chunks)) {
+      return nullptr;
+    }
+    std::array<Pixel, 256> palette{};
+    if(ihdr.colorType() == 3) {
+      auto plte = find_if(begin(chunks), end(chunks), [](auto const& c) { return PNG::type(*c) == PLTEChunk::type_; });
+      if(plte == end(chunks)) {
+        std::cerr << "PLTE chunk not found" << std::endl;
+        return nullptr;
+      }
+      auto const& p = std::get<PLTEChunk>(**plte).palette();
+      std::copy_n(begin(p), std::min(p.size(), palette.size()), begin(palette));
+    }
+    bool const interlaced = ihdr.interlace() == 1;
+    auto strp = find_if(begin(chunks), end(chunks), [](auto const& c) { return PNG::type(*c) == stRPChunk::type_; });
+    if(strp != end(chunks) && !interlaced) {
+      std::vector<Byte> const data = idat.readAll();
+      idat.finish();
+      return decodeStrips(ihdr, std::get<stRPChunk>(**strp), data, expand, palette.data(), bpp);
+    }
+
+    auto const unfilters = Filter::unfilters(bpp);
+    // 8bit RGB は画素の並びがそのまま行のバイト列なので、出力バッファの上で直接戻す。
+    bool const direct = !interlaced && ihdr.colorType() == 2 && ihdr.depth() == 8;
+    std::vector<Byte> const zero(stride);
+    // マップしたファイルで 8bit RGB の IDAT が1つだけなら、Inflate でその場所から画素の領域へ一度に伸長する。
+    // 行ごとのフィルタタイプの分だけ大きく確保して伸長し、上の行から戻しながら行の先頭へ詰める。
+    // 詰めた先は今の行の伸長済みの位置より前で、1つ上の行は既に詰めてあるので、まだ使う部分は上書きしない。
+    if(direct && reader.inPlace()) {
+      std::span<Byte const> const data = idat.single();
+      if(!data.empty()) {
+        idat.finish();
+        size_t const size = rawSize(ihdr);
+        // deflate は 1 バイトを高々約 1032 バイトにしか伸ばせないので、それを超える IHDR は確保する前に弾く。
+        if(size / 1032 > data.size()) {
+          std::cerr << "image data is too short" << std::endl;
+          return nullptr;
+        }
+        Pixels pixels((size + sizeof(Pixel) - 1) / sizeof(Pixel));
+        Byte* const buf = reinterpret_cast<Byte*>(pixels.data());
+        if(!Deflate::decompress(data.data(), data.size(), buf, size)) {
+          std::cerr << "inflate failed" << std::endl;
+          return nullptr;
+        }
+        Byte const* prev = zero.data();
+        for(size_t y{0}; y < height; ++y) {
+          Byte* const row = buf + y * (stride + 1);
+          if(row[0] >= unfilters.size()) {
+            std::cerr << "unknown filter type: " << static_cast<int>(row[0]) << std::endl;
+            return nullptr;
+          }
+          unfilters[row[0]](row + 1, prev, stride);
+          Byte* const dst = buf + y * stride;
+          std::memmove(dst, row + 1, stride);
+          prev = dst;
+        }
+        pixels.resize(width * height);
+        return std::make_unique<Image>(width, height, std::move(pixels));
+      }
+    }
+    Pixels pixels(width * height);
+    // 8bit RGB 以外は前の行と今の行の 2 行だけを持って、戻してから展開する。
+    size_t const bits = channels(ihdr.colorType()) * ihdr.depth();
+    std::vector<Byte> window(direct ? 0 : stride * 2);
+    // インターレースの時は縮小画像の行に展開してから、最終画像の行へ dx おきに書き込む。
+    Pixels reduced;
+    auto const ps = passes(ihdr);
+    for(size_t p{0}; p < ps.size(); ++p) {
+      Pass const& pass = ps[p];
+      size_t const pw = pass.width(width);
+      size_t const ph = pass.height(height);
+      if(pw == 0 || ph == 0) {
+        continue;
+      }
+      size_t const passStride = (pw * bits + 7) / 8;
+      bool const keep = interlaced && onPass;
+      reduced.resize(keep ? pw * ph : pw);
+      Byte const* prev = zero.data();
+      for(size_t r{0}; r < ph; ++r) {
+        size_t const y = pass.y0 + r * pass.dy;
+        Byte* row = direct ? reinterpret_cast<Byte*>(pixels.data() + y * width) : window.data() + (r % 2) * stride;
+        Byte type;
+        if(!idat.read(&type, 1) || !idat.read(row, passStride)) {
+          return nullptr;
+        }
+        if(type >= unfilters.size()) {
+          std::cerr << "unknown filter type: " << static_cast<int>(type) << std::endl;
+          return nullptr;
+        }
+        unfilters[type](row, prev, passStride);
+        prev = row;
+        if(direct) {
+          continue;
+        }
+        if(!interlaced) {
+          expand(row, pixels.data() + y * width, width, palette.data());
+          continue;
+        }
+        Pixel* const src = reduced.data() + (keep ? r * pw : 0);
+        expand(row, src, pw, palette.data());
+        Pixel* const dst = pixels.data() + y * width + pass.x0;
+        for(size_t i{0}; i < pw; ++i) {
+          dst[i * pass.dx] = src[i];
+        }
+      }
+      if(keep) {
+        onPass(p + 1, Image{pw, ph, reduced});
+      }
+    }
+    if(!idat.verify()) {
+      return nullptr;
+    }
+    idat.finish();
     return std::make_unique<Image>(width, height, std::move(pixels));
   }
 
-  std::unique_ptr<Chunk> makeIHDR(size_t width, size_t height) {
-    return std::make_unique<Chunk>(IHDRChunk{width, height, 8, 2, 0, 0, 0});
+  std::unique_ptr<Image> loadProgressive(std::istream& fs, PassCallback const& onPass) {
+    StreamChunkReader reader{fs};
+    return decode(reader, onPass);
   }
 
-  std::pair<int, std::vector<Pixel>> filter(std::vector<Pixel>::const_iterator s,
-                                            std::vector<Pixel>::const_iterator g,
-                                            std::vector<Pixel>::const_iterator end,
-                                            std::vector<Pixel>::const_iterator pre_s) {
-    size_t size = std::distance(s, g);
-    std::vector<std::vector<Pixel>> filters(5, std::vector<Pixel>(size));
-    // とりあえず全てのフィルタの動作が実装されていて、全て実行されているが、最後に1つの結果しか使っていない。
+  std::unique_ptr<Image> load(std::istream& fs) {
+    return loadProgressive(fs, nullptr);
+  }
 
-    // none filter
-    std::copy(s, g, begin(filters[0]));
+  std::unique_ptr<Image> loadFile(std::string const& path) {
+    MappedFile const file{path};
+    if(!file.ok()) {
+      // パイプなどマップできないものは普通に読む。
+      std::ifstream fs{path, std::ios::binary};
+      if(!fs) {
+        std::cerr << "cannot open " << path << std::endl;
+        return nullptr;
+      }
+      return load(fs);
+    }
+    MappedChunkReader reader{file.data(), file.size()};
+    return decode(reader, nullptr);
+  }
 
-    // sub filter
-    {
-      auto out = begin(filters[1]);
-      Pixel pre{};
-      for(auto it{s}; it != g; ++it) {
-        *(out++) = *it - pre;
-        pre = *it;
+  std::unique_ptr<Chunk> makeIHDR(size_t width, size_t height, ColorFormat const& format) {
+    return std::make_unique<Chunk>(IHDRChunk{width, height, format.depth, format.colorType, 0, 0, 0});
+  }
+
+  // 灰色 v を誤差なく表せる最小のビット深度。
+  int grayDepth(Byte v) {
+    return v % 255 == 0 ? 1 : v % 85 == 0 ? 2 : v % 17 == 0 ? 4 : 8;
+  }
+
+  int paletteDepth(size_t colors) {
+    return colors <= 2 ? 1 : colors <= 4 ? 2 : colors <= 16 ? 4 : 8;
+  }
+
+  // Pixel の行を ColorFormat のバイト列に詰める。8bit RGB の時は写さずにそのまま返す。
+  class RowPacker {
+  public:
+    RowPacker(size_t width, ColorFormat const& format)
+      : width_{width}, format_{format}, table_{format.palette}, row_(stride(width, format)) {}
+
+    static size_t stride(size_t width, ColorFormat const& format) {
+      return (width * channels(format.colorType) * format.depth + 7) / 8;
+    }
+
+    Byte const* pack(Pixel const* pixels) {
+      if(format_.colorType == 2) {
+        return reinterpret_cast<Byte const*>(pixels);
+      }
+      int const depth = format_.depth;
+      if(depth < 8) {
+        std::fill(begin(row_), end(row_), 0);
       }
+      // 灰色は 255 / (2^depth - 1) 刻みなので、その刻みで割れば depth ビットに収まる。
+      int const step = 255 / ((1 << depth) - 1);
+      for(size_t x{0}; x < width_; ++x) {
+        int const v = format_.colorType == 3 ? table_.index(pixels[x]) : pixels[x].r / step;
+        if(depth == 8) {
+          row_[x] = v;
+        } else {
+          size_t const bit = x * depth;
+          row_[bit / 8] |= v << (8 - depth - bit % 8);
+        }
+      }
+      return row_.data();
     }
 
-    // up filter
-    {
-      auto out = begin(filters[2]);
-      for(auto it{s}; it != g; ++it) {
-        Pixel up{};
-        if(pre_s != end) {
-          up = *(pre_s++);
+    // カラータイプ 3 で、format のパレットの色の番号の行を詰める。8bit の時は写さずにそのまま返す。
+    Byte const* packIndices(Byte const* indices) {
+      int const depth = format_.depth;
+      if(depth == 8) {
+        return indices;
+      }
+      std::fill(begin(row_), end(row_), 0);
+      for(size_t x{0}; x < width_; ++x) {
+        size_t const bit = x * depth;
+        row_[bit / 8] |= indices[x] << (8 - depth - bit % 8);
+      }
+      return row_.data();
+    }
+
+  private:
+    size_t const width_;
+    ColorFormat const& format_;
+    ColorTable table_;
+    std::vector<Byte> row_;
+  };
+
+  // 1行分のフィルタの候補を持ち、FilterMode に従って1つ選ぶ。候補のバッファは行をまたいで使い回す。
+  class RowFilter {
+  public:
+    RowFilter(size_t stride, size_t bpp, FilterMode mode) : filters_{Filter::filters(bpp)}, mode_{mode} {
+      if(mode_ == FilterMode::MinSum || mode_ == FilterMode::BruteForce) {
+        for(auto& c: candidates_) {
+          c.resize(stride);
         }
-        *(out++) = *it - up;
       }
     }
 
-    // average filter
-    {
-      auto out = begin(filters[3]);
-      Pixel pre{};
-      for(auto it{s}; it != g; ++it) {
-        Pixel up{};
-        auto p = *it;
-        if(pre_s != end) {
-          up = *(pre_s++);
+    // row をフィルタして out (先頭にフィルタタイプ、続けて stride バイト) に書く。
+    // restart なら上の行を見ないフィルタ(None か Sub)だけを使い、この行から別々に戻せるようにする。
+    void apply(Byte* out, Byte const* row, Byte const* prev, size_t stride, bool restart = false) {
+      size_t const types = restart ? 2 : filters_.size();
+      if(mode_ != FilterMode::MinSum && mode_ != FilterMode::BruteForce) {
+        int const type = std::min<int>(static_cast<int>(mode_), types - 1);
+        out[0] = type;
+        filters_[type](out + 1, row, prev, stride);
+        return;
+      }
+      size_t best{0};
+      size_t bestScore{SIZE_MAX};
+      for(size_t type{0}; type < types; ++type) {
+        Byte* c = candidates_[type].data();
+        filters_[type](c, row, prev, stride);
+        size_t const score = mode_ == FilterMode::MinSum ? Filter::sumAbs(c, stride) : estimator_.size(c, stride);
+        if(score < bestScore) {
+          best = type;
+          bestScore = score;
         }
-        *(out++) = p - average(pre, up);
-        pre = p;
       }
+      out[0] = best;
+      std::copy_n(candidates_[best].data(), stride, out + 1);
     }
 
-    // paeth filter
-    {
-      auto out = begin(filters[4]);
-      Pixel pre{};
-      Pixel up_pre{};
-      for(auto it{s}; it != g; ++it) {
-        auto p = *it;
-        auto up = (pre_s == end) ? Pixel{} : *(pre_s++);
-        auto naname = up_pre;
-        auto diff = p - paethPredictor(pre, up, naname);
-        *(out++) = diff;
-        pre = p;
-        up_pre = up;
+  private:
+    Filter::Filters const filters_;
+    FilterMode const mode_;
+    std::array<std::vector<Byte>, 5> candidates_;
+    Deflate::Estimator estimator_;
+  };
+
+  // format が IndexedImage のパレットそのものなら、その色の番号。そうでなければ nullptr。
+  // この時は色を引かずに番号をそのまま詰められるので、画像の色を作らずに済む。
+  Byte const* paletteIndices(Image const& img, ColorFormat const& format) {
+    auto indexed = dynamic_cast<IndexedImage const*>(&img);
+    if(!indexed || !indexed->hasIndices() || format.colorType != 3) {
+      return nullptr;
+    }
+    auto const& palette = indexed->palette();
+    bool const same = std::equal(begin(palette), end(palette), begin(format.palette), end(format.palette),
+                                 [](Pixel const& a, Pixel const& b) { return a.r == b.r && a.g == b.g && a.b == b.b; });
+    return same ? indexed->indices().data() : nullptr;
+  }
+
+  // 画像の全ての画素を表せる形式を、詰めた後の大きさの小さい順に返す。最後は必ず 8bit RGB。
+  // IndexedImage なら画素は調べず、パレットの色だけを見て、パレットはそのまま使う。
+  std::vector<ColorFormat> colorFormats(Image const& img) {
+    bool gray{true};
+    int depth{1};
+    bool fits{true};
+    ColorTable table;
+    auto indexed = dynamic_cast<IndexedImage const*>(&img);
+    bool const hasIndices = indexed && indexed->hasIndices() && indexed->palette().size() <= 256;
+    std::span<Pixel const> const pixels = hasIndices ? std::span<Pixel const>{indexed->palette()} : std::span<Pixel const>{img.pixels()};
+    for(size_t i{0}; i < pixels.size() && (gray || fits); ++i) {
+      Pixel const p = pixels[i];
+      // 同じ色が続くことが多いので、直前と同じなら調べない。
+      if(i != 0 && p.r == pixels[i - 1].r && p.g == pixels[i - 1].g && p.b == pixels[i - 1].b) {
+        continue;
       }
+      if(gray) {
+        gray = p.r == p.g && p.g == p.b;
+        depth = std::max(depth, grayDepth(p.r));
+      }
+      fits = fits && table.index(p) >= 0;
     }
 
-    return std::make_pair(2, filters[2]);
+    // 詰めた後の大きさに PLTE チャンクの分を足して比べる。同じならグレースケール、パレットの順に選ぶ。
+    auto cost = [&](ColorFormat const& f) {
+      return (RowPacker::stride(img.width(), f) + 1) * img.height() + (f.palette.empty() ? 0 : 12 + 3 * f.palette.size());
+    };
+    std::vector<ColorFormat> candidates;
+    if(gray) {
+      candidates.push_back(ColorFormat{0, static_cast<Byte>(depth), {}});
+    }
+    if(hasIndices) {
+      candidates.push_back(ColorFormat{3, static_cast<Byte>(paletteDepth(pixels.size())), indexed->palette()});
+    } else if(fits) {
+      candidates.push_back(ColorFormat{3, static_cast<Byte>(paletteDepth(table.colors().size())), table.colors()});
+    }
+    candidates.push_back(ColorFormat{});
+    std::stable_sort(begin(candidates), end(candidates), [&](auto const& a, auto const& b) { return cost(a) < cost(b); });
+    return candidates;
+  }
+
+  ColorFormat analyze(Image const& img) {
+    return colorFormats(img).front();
+  }
+
+  // パレットや 8bit 未満の画像は画素がバイトにそろわないので、フィルタの効果が薄い。
+  // 仕様の勧めに従って、MinSum の時はフィルタしない。
+  FilterMode filterMode(ExportOptions const& options, ColorFormat const& format) {
+    bool const packed = format.colorType == 3 || format.depth < 8;
+    return packed && options.filter == FilterMode::MinSum ? FilterMode::None : options.filter;
+  }
+
+  // stRP を書くのは区間ごとに並列に圧縮する時だけ。Encoder は先に stRP を書けないので使わない。
+  size_t restartRows(ExportOptions const& options) {
+    return options.parallel ? options.restartRows : 0;
   }
 
-  std::unique_ptr<Chunk> makeIDAT(size_t width, size_t height, std::vector<Pixel> const& pixels) {
-    std::vector<Byte> data((width * 3 + 1) * height);
-    auto s = begin(pixels);
-    auto g = begin(pixels);
-    std::advance(g, width);
-    decltype(s) pre_s = end(pixels);
+  std::unique_ptr<Chunk> makeIDAT(Image const& img, ExportOptions const& options, ColorFormat const& format) {
+    size_t const width = img.width();
+    size_t const height = img.height();
+    Byte const* const indices = paletteIndices(img, format);
+    Pixel const* const pixels = indices ? nullptr : img.pixels().data();
+    size_t const stride = RowPacker::stride(width, format);
+    size_t const bpp = std::max<size_t>(1, channels(format.colorType) * format.depth / 8);
+    std::vector<Byte> data((stride + 1) * height);
+    std::vector<Byte> const zero(stride);
 
-    for(size_t i{0}; i < height; ++i) {
-      size_t const base{(width * 3 + 1) * i};
-      std::pair<int, std::vector<Pixel>> const v = filter(s, g, end(pixels), pre_s);
-      std::vector<Pixel> const& ps = v.second;
-      data[base] = v.first;
-      for(size_t j{0}; j < width; ++j) {
-        Pixel const p = ps[j];
-        data[base + 1 + 3 * j] = p.r;
-        data[base + 1 + 3 * j + 1] = p.g;
-        data[base + 1 + 3 * j + 2] = p.b;
+    // フィルタは元の画素だけを見るので、行はどの順に処理してもよい。区間ごとに RowPacker と RowFilter を持つ。
+    // restartRows の時は区間をそれに合わせ、区間の先頭行は上の行を見ないフィルタにする。
+    size_t const rowsPerStrip = restartRows(options) != 0 ? restartRows(options) : options.parallel ? 64 : std::max<size_t>(height, 1);
+    size_t const strips = (height + rowsPerStrip - 1) / rowsPerStrip;
+    auto filterStrip = [&](size_t s) {
+      size_t const first = s * rowsPerStrip;
+      // 1つ上の行も詰めてから比べるので、詰めた行を2行分持つ。
+      RowPacker packers[2] = {RowPacker{width, format}, RowPacker{width, format}};
+      RowFilter filter{stride, bpp, filterMode(options, format)};
+      auto pack = [&](RowPacker& packer, size_t y) {
+        return indices ? packer.packIndices(indices + width * y) : packer.pack(pixels + width * y);
+      };
+      Byte const* prev = first == 0 ? zero.data() : pack(packers[(first + 1) % 2], first - 1);
+      for(size_t i{first}; i < std::min(height, first + rowsPerStrip); ++i) {
+        Byte const* row = pack(packers[i % 2], i);
+        filter.apply(data.data() + (stride + 1) * i, row, prev, stride, i != 0 && i == first && restartRows(options) != 0);
+        prev = row;
       }
-      pre_s = s;
-      std::advance(s, width);
-      std::advance(g, width);
+    };
+    if(options.parallel) {
+      parallelFor(strips, filterStrip);
+    } else if(strips != 0) {
+      filterStrip(0);
     }
-    return std::make_unique<Chunk>(IDATChunk{data});
+    return std::make_unique<Chunk>(IDATChunk{std::move(data)});
   }
 
-  std::vector<std::unique_ptr<Chunk>> makeChunks(size_t width, size_t height, std::vector<Pixel> const& pixels) {
+  std::vector<std::unique_ptr<Chunk>> makeChunks(Image const& img, ExportOptions const& options, ColorFormat const& format) {
     std::vector<std::unique_ptr<Chunk>> v;
-    v.push_back(makeIHDR(width, height));
-    v.push_back(makeIDAT(width, height, pixels));
-    v.push_back(std::make_unique<Chunk>(BaseChunk{"IEND"}));
+    v.push_back(makeIHDR(img.width(), img.height(), format));
+    if(!format.palette.empty()) {
+      v.push_back(std::make_unique<Chunk>(PLTEChunk{std::vector<Pixel>{format.palette}}));
+    }
+    v.push_back(makeIDAT(img, options, format));
+    v.push_back(std::make_unique<Chunk>(BaseChunk{IEND}));
     return v;
   }
 
@@ -477,11 +1192,11 @@ namespace PNG {
     buf.push_back((size >>  0) & 0xff);
   }
 
-  void putSize(std::ostream& os, size_t size) {
-    os << static_cast<Byte>((size >> 24) & 0xff);
-    os << static_cast<Byte>((size >> 16) & 0xff);
-    os << static_cast<Byte>((size >>  8) & 0xff);
-    os << static_cast<Byte>((size >>  0) & 0xff);
+  void putSize(ByteSink& os, size_t size) {
+    os.put((size >> 24) & 0xff);
+    os.put((size >> 16) & 0xff);
+    os.put((size >>  8) & 0xff);
+    os.put((size >>  0) & 0xff);
   }
 
   void putString(std::vector<Byte>& buf, std::string str) {
@@ -490,16 +1205,22 @@ namespace PNG {
     }
   }
 
-  void flush(std::ostream& os, std::vector<Byte> const& buf) {
-    for(Byte b: buf) {
-      os << b;
-    }
-    for(Byte b: crc(buf)) {
-      os << b;
-    }
+  void flush(ByteSink& os, std::vector<Byte> const& buf) {
+    os.write(buf.data(), buf.size());
+    std::array<Byte, 4> const c = crc(buf);
+    os.write(c.data(), c.size());
+  }
+
+  // 大きなデータをバッファに写さずに、型と中身から CRC を続けて計算して書く。
+  void flush(ByteSink& os, std::string const& type, Byte const* data, size_t size) {
+    Byte const* t = reinterpret_cast<Byte const*>(type.data());
+    std::array<Byte, 4> const c = crcBytes(Checksum::crc32(Checksum::crc32(0, t, type.size()), data, size));
+    os.write(type);
+    os.write(data, size);
+    os.write(c.data(), c.size());
   }
 
-  void putIHDRChunk(std::ostream& os, IHDRChunk const& c) {
+  void putIHDRChunk(ByteSink& os, IHDRChunk const& c) {
     std::vector<Byte> buf;
     putSize(os, 13);
 
@@ -514,63 +1235,409 @@ namespace PNG {
     flush(os, buf);
   }
 
-  void putIDATChunk(std::ostream& os, IDATChunk const& c) {
+  void putPLTEChunk(ByteSink& os, PLTEChunk const& c) {
     std::vector<Byte> buf;
-    std::vector<Byte> compressed = Deflate::compress(c.data());
-    putSize(os, compressed.size());
+    putSize(os, c.palette().size() * 3);
+    putString(buf, "PLTE");
+    for(Pixel const& p: c.palette()) {
+      buf.push_back(p.r);
+      buf.push_back(p.g);
+      buf.push_back(p.b);
+    }
+    flush(os, buf);
+  }
 
-    putString(buf, "IDAT");
-    std::copy(begin(compressed), end(compressed), std::back_inserter(buf));
+  // 圧縮済みのデータを chunkSize バイトごとの IDAT チャンクにして書く。
+  void putIDATChunks(ByteSink& os, std::vector<Byte> const& compressed, size_t chunkSize) {
+    chunkSize = std::max<size_t>(chunkSize, 1);
+    for(size_t offset{0}; offset < compressed.size(); offset += chunkSize) {
+      size_t const size = std::min(chunkSize, compressed.size() - offset);
+      putSize(os, size);
+      flush(os, "IDAT", compressed.data() + offset, size);
+    }
+  }
+
+  void putstRPChunk(ByteSink& os, stRPChunk const& c) {
+    std::vector<Byte> buf;
+    putSize(os, c.restarts().size() * 8);
+    putString(buf, "stRP");
+    for(auto const& r: c.restarts()) {
+      putSize(buf, r.row);
+      putSize(buf, r.offset);
+    }
     flush(os, buf);
   }
 
-  void putIENDChunk(std::ostream& os) {
+  bool putIDATChunk(ByteSink& os, IDATChunk const& c, ExportOptions const& options, size_t rowSize) {
+    if(restartRows(options) != 0) {
+      // restartRows 行ごとに辞書を切って圧縮し、その位置を stRP にして IDAT の前に書く。
+      std::vector<size_t> offsets;
+      std::vector<Byte> compressed = Deflate::compressIndependent(c.data(), restartRows(options) * rowSize, options.level, offsets);
+      if(compressed.empty()) {
+        std::cerr << "deflate failed" << std::endl;
+        return false;
+      }
+      std::vector<stRPChunk::Restart> restarts;
+      for(size_t i{0}; i < offsets.size(); ++i) {
+        restarts.push_back({(i + 1) * restartRows(options), offsets[i]});
+      }
+      if(!restarts.empty()) {
+        putstRPChunk(os, stRPChunk{std::move(restarts)});
+      }
+      putIDATChunks(os, compressed, options.chunkSize);
+      return true;
+    }
+    std::vector<Byte> compressed = options.parallel ? Deflate::compressParallel(c.data(), options.level) : Deflate::compress(c.data(), options.level);
+    if(compressed.empty()) {
+      std::cerr << "deflate failed" << std::endl;
+      return false;
+    }
+    putIDATChunks(os, compressed, options.chunkSize);
+    return true;
+  }
+
+  void putIENDChunk(ByteSink& os) {
     putSize(os, 0);
     std::vector<Byte> buf;
     putString(buf, "IEND");
     flush(os, buf);
   }
 
-  void putChunks(std::ostream& os, std::vector<std::unique_ptr<Chunk>>& chunks) {
+  // 圧縮に失敗したら、そこで止めて false を返す。
+  bool putChunks(ByteSink& os, std::vector<std::unique_ptr<Chunk>>& chunks, ExportOptions const& options) {
+    size_t rowSize{0};
     for(auto& c: chunks) {
-      std::string const& type = PNG::type(*c);
-      if(type == "IHDR") {
+      uint32_t const type = PNG::type(*c);
+      switch(type) {
+      case IHDRChunk::type_:
         putIHDRChunk(os, std::get<IHDRChunk>(*c));
-      } else if (type == "IDAT") {
-        putIDATChunk(os, std::get<IDATChunk>(*c));
-      } else if (type == "IEND") {
+        rowSize = PNG::stride(std::get<IHDRChunk>(*c)) + 1;
+        break;
+      case PLTEChunk::type_:
+        putPLTEChunk(os, std::get<PLTEChunk>(*c));
+        break;
+      case IDATChunk::type_:
+        if(!putIDATChunk(os, std::get<IDATChunk>(*c), options, rowSize)) {
+          return false;
+        }
+        break;
+      case IEND:
         putIENDChunk(os);
-      } else {
-        std::cerr << "unknown chunk type(" << type << ") skipping..." << std::endl;
+        break;
+      default:
+        std::cerr << "unknown chunk type(" << typeName(type) << ") skipping..." << std::endl;
+      }
+    }
+    return true;
+  }
+
+  struct Encoder::State {
+    State(ByteSink& os_, size_t width, size_t height, ExportOptions const& options, ColorFormat const& format_)
+      : os{os_}, format{format_}, height{height}, stride{RowPacker::stride(width, format)}, rows{0},
+        chunkSize{std::max<size_t>(options.chunkSize, 1)}, packer{width, format}, prev(stride), filtered(stride + 1),
+        filter{stride, std::max<size_t>(1, channels(format.colorType) * format.depth / 8), filterMode(options, format)},
+        crc{idatCrc()}, good{true},
+        deflater{[this](Byte const* data, size_t size) { put(data, size); }, options.level} {
+    }
+
+    // 詰めた1行をフィルタして圧縮する。
+    bool writePacked(Byte const* bytes) {
+      filter.apply(filtered.data(), bytes, prev.data(), stride);
+      std::copy_n(bytes, stride, prev.data());
+      ++rows;
+      good = deflater.write(filtered.data(), filtered.size()) && good;
+      return good;
+    }
+
+    static uint32_t idatCrc() {
+      std::array<Byte, 4> const type{'I', 'D', 'A', 'T'};
+      return Checksum::crc32(0, type.data(), type.size());
+    }
+
+    // 圧縮された分を IDAT チャンクに詰め、いっぱいになったら書き出す。
+    void put(Byte const* data, size_t size) {
+      while(size > 0) {
+        size_t const n = std::min(size, chunkSize - idat.size());
+        idat.insert(end(idat), data, data + n);
+        crc = Checksum::crc32(crc, data, n);
+        data += n;
+        size -= n;
+        if(idat.size() == chunkSize) {
+          emit();
+        }
       }
     }
+
+    void emit() {
+      if(idat.empty()) {
+        return;
+      }
+      putSize(os, idat.size());
+      std::array<Byte, 4> const c = crcBytes(crc);
+      os.write("IDAT");
+      os.write(idat.data(), idat.size());
+      os.write(c.data(), c.size());
+      idat.clear();
+      crc = idatCrc();
+    }
+
+    ByteSink& os;
+    ColorFormat const format;
+    size_t const height;
+    size_t const stride;
+    size_t rows;
+    size_t const chunkSize;
+    RowPacker packer;
+    std::vector<Byte> prev;
+    std::vector<Byte> filtered;
+    RowFilter filter;
+    std::vector<Byte> idat;
+    uint32_t crc;
+    bool good;
+    // 作った時点でヘッダを put するので、put が使うものより後に置く。
+    Deflate::Deflater deflater;
+  };
+
+  Encoder::Encoder(ByteSink& os, size_t width, size_t height, ExportOptions const& options, ColorFormat const& format)
+    : state{std::make_unique<State>(os, width, height, options, format)} {
+    os.write(pngSigneture.data(), pngSigneture.size());
+    putIHDRChunk(os, std::get<IHDRChunk>(*makeIHDR(width, height, format)));
+    if(!format.palette.empty()) {
+      putPLTEChunk(os, PLTEChunk{std::vector<Pixel>{format.palette}});
+    }
+  }
+
+  Encoder::~Encoder() = default;
+
+  bool Encoder::writeRow(Pixel const* row) {
+    State& s = *state;
+    if(s.rows == s.height) {
+      std::cerr << "too many rows" << std::endl;
+      return false;
+    }
+    return s.writePacked(s.packer.pack(row));
   }
 
-  std::unique_ptr<Image> exportPNG(std::unique_ptr<Image>&& img, std::ostream& os) {
-    for(Byte b: pngSigneture) {
-      os << b;
+  bool Encoder::writeIndices(Byte const* row) {
+    State& s = *state;
+    if(s.rows == s.height) {
+      std::cerr << "too many rows" << std::endl;
+      return false;
+    }
+    if(s.format.colorType != 3) {
+      std::cerr << "color indices for non-palette format" << std::endl;
+      return false;
+    }
+    return s.writePacked(s.packer.packIndices(row));
+  }
+
+  bool Encoder::finish() {
+    State& s = *state;
+    if(s.rows != s.height) {
+      std::cerr << "expected " << s.height << " rows, but got " << s.rows << std::endl;
+      return false;
+    }
+    s.good = s.deflater.finish() && s.good;
+    s.emit();
+    putIENDChunk(s.os);
+    return s.good;
+  }
+
+  std::optional<ExportOptions> preset(std::string const& name) {
+    ExportOptions options;
+    if(name == "stored") {
+      options.filter = FilterMode::None;
+      options.level = Deflate::Level::Stored;
+    } else if(name == "rle") {
+      options.level = Deflate::Level::RLE;
+    } else if(name == "fast") {
+      options.level = Deflate::Level::Fast;
+    } else if(name == "max") {
+      options.filter = FilterMode::BruteForce;
+      options.level = Deflate::Level::Max;
+    } else if(name == "palette") {
+      options.colors = 256;
+    } else if(name == "strips") {
+      options.restartRows = 64;
+    } else if(name == "stream") {
+      options.parallel = false;
+    } else if(name != "default") {
+      return std::nullopt;
+    }
+    return options;
+  }
+
+  std::unique_ptr<Image> exportPNG(std::unique_ptr<Image>&& img, ByteSink& os, ExportOptions const& options) {
+    // 既に colors 色以下のパレットを持つ画像は減色しない。
+    auto indexed = dynamic_cast<IndexedImage const*>(img.get());
+    bool const fits = indexed && indexed->hasIndices() && indexed->palette().size() <= options.colors;
+    std::unique_ptr<Image> quantized = options.colors != 0 && !fits ? Quantize::apply(*img, Quantize::palette(*img, {options.colors})) : nullptr;
+    Image const& source = quantized ? *quantized : *img;
+    ColorFormat const format = options.reduce ? analyze(source) : ColorFormat{};
+    if(!options.parallel) {
+      Encoder encoder{os, source.width(), source.height(), options, format};
+      Byte const* const indices = paletteIndices(source, format);
+      for(size_t y{0}; y < source.height(); ++y) {
+        bool const ok = indices ? encoder.writeIndices(indices + source.width() * y) : encoder.writeRow(source.pixels().data() + source.width() * y);
+        if(!ok) {
+          std::cerr << "failed to encode row " << y << std::endl;
+          return nullptr;
+        }
+      }
+      if(!encoder.finish()) {
+        return nullptr;
+      }
+      return std::move(img);
+    }
+    os.write(pngSigneture.data(), pngSigneture.size());
+    std::vector<std::unique_ptr<Chunk>> chunks = makeChunks(source, options, format);
+    if(!putChunks(os, chunks, options)) {
+      return nullptr;
     }
-    std::vector<std::unique_ptr<Chunk>> chunks = makeChunks(img->width(), img->height(), img->pixels());
-    putChunks(os, chunks);
     return std::move(img);
   }
 
+  std::unique_ptr<Image> exportPNG(std::unique_ptr<Image>&& img, ByteSink& os) {
+    return exportPNG(std::move(img), os, ExportOptions{});
+  }
+
+  // optimize で試す組み合わせ。1つの形式とフィルタについて、フィルタした結果を levels の全てで圧縮してみる。
+  // 先に試すものほど小さくなりやすいように並べ、早く良い結果を得て他の試行を早く打ち切れるようにする。
+  // RLE はフィルタした画像では Max より小さくなることがあるので残す。
+  std::array<FilterMode, 7> const optimizeFilters{FilterMode::MinSum, FilterMode::BruteForce, FilterMode::Paeth, FilterMode::Up, FilterMode::Sub, FilterMode::Average, FilterMode::None};
+  std::array<Deflate::Level, 3> const optimizeLevels{Deflate::Level::Max, Deflate::Level::RLE, Deflate::Level::Default};
+
+  bool optimize(Image const& img, ByteSink& os, OptimizeOptions const& options) {
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point const deadline = Clock::now() + options.budget;
+    bool const timed = options.budget.count() > 0;
+
+    struct Trial {
+      size_t format;
+      FilterMode filter;
+    };
+    std::vector<ColorFormat> const formats = colorFormats(img);
+    std::vector<Trial> trials;
+    for(size_t f{0}; f < formats.size(); ++f) {
+      for(FilterMode filter: optimizeFilters) {
+        ExportOptions o;
+        o.filter = filter;
+        // パレットなどで MinSum は None と同じになるので、重ねて試さない。
+        if(filterMode(o, formats[f]) == filter) {
+          trials.push_back(Trial{f, filter});
+        }
+      }
+    }
+
+    // 最も小さいものを選ぶ。同じ大きさなら番号の小さい方にするので、時間切れにならなければ結果は実行順によらない。
+    struct Best {
+      size_t size{SIZE_MAX};
+      size_t index{SIZE_MAX};
+      std::vector<Byte> data;
+    };
+    Best best;
+    std::mutex mutex;
+    // 途中の試行が比べる大きさ。これを超えたら勝てないので打ち切る(等しければ番号で勝つかもしれないので続ける)。
+    std::atomic<size_t> bound{SIZE_MAX};
+    std::atomic<size_t> done{0};
+
+    parallelFor(trials.size(), [&](size_t t) {
+      // 最初の試行(convert の既定と同じ形式とフィルタ)だけは時間切れでも止めず、必ず1つは結果を残す。
+      auto expired = [&]() { return timed && t != 0 && Clock::now() > deadline; };
+      if(expired()) {
+        return;
+      }
+      ColorFormat const& format = formats[trials[t].format];
+      ExportOptions o;
+      o.filter = trials[t].filter;
+      o.parallel = false;
+      std::unique_ptr<Chunk> const idat = makeIDAT(img, o, format);
+      std::vector<Byte> const& filtered = std::get<IDATChunk>(*idat).data();
+      size_t const overhead = format.palette.empty() ? 0 : 12 + 3 * format.palette.size();
+
+      for(size_t l{0}; l < optimizeLevels.size(); ++l) {
+        std::vector<Byte> compressed;
+        Deflate::Deflater deflater{[&](Byte const* data, size_t size) { compressed.insert(end(compressed), data, data + size); }, optimizeLevels[l]};
+        size_t const piece{64 * 1024};
+        bool stopped{false};
+        for(size_t offset{0}; offset < filtered.size() && !stopped; offset += piece) {
+          deflater.write(filtered.data() + offset, std::min(piece, filtered.size() - offset));
+          stopped = compressed.size() + overhead > bound || expired();
+        }
+        if(stopped || !deflater.finish()) {
+          continue;
+        }
+        ++done;
+        size_t const size = compressed.size() + overhead;
+        size_t const index = t * optimizeLevels.size() + l;
+        std::lock_guard<std::mutex> lock{mutex};
+        if(size < best.size || (size == best.size && index < best.index)) {
+          best = Best{size, index, std::move(compressed)};
+          bound = size;
+        }
+      }
+    });
+
+    if(best.data.empty()) {
+      std::cerr << "failed to optimize" << std::endl;
+      return false;
+    }
+    Trial const& trial = trials[best.index / optimizeLevels.size()];
+    ColorFormat const& format = formats[trial.format];
+    std::cerr << "optimize: " << done << "/" << trials.size() * optimizeLevels.size() << " trials finished, chose color type " << +format.colorType
+              << " depth " << +format.depth << ", filter " << static_cast<int>(trial.filter)
+              << ", level " << static_cast<int>(optimizeLevels[best.index % optimizeLevels.size()]) << std::endl;
+
+    os.write(pngSigneture.data(), pngSigneture.size());
+    putIHDRChunk(os, std::get<IHDRChunk>(*makeIHDR(img.width(), img.height(), format)));
+    if(!format.palette.empty()) {
+      putPLTEChunk(os, PLTEChunk{std::vector<Pixel>{format.palette}});
+    }
+    putIDATChunks(os, best.data, ExportOptions{}.chunkSize);
+    putIENDChunk(os);
+    return os.good();
+  }
+
   std::string showChunk(auto const& c) {
     if constexpr(requires { c.show(); }) {
       return c.show();
     }
-    return c.type();
+    return typeName(c.type());
   }
 
   void showInfo(std::istream& fs) {
-    if(!readHeader(fs)) {
+    StreamChunkReader reader{fs};
+    if(!reader.signature()) {
       std::cerr << "not png file" << std::endl;
       return;
     }
 
-    std::vector<std::unique_ptr<Chunk>> chunks = readChunks(fs);
+    std::vector<std::unique_ptr<Chunk>> chunks = readChunks(reader);
+    std::vector<Byte> idat;
     for(auto const& e: chunks) {
       std::visit([](auto const& e){ std::cout << showChunk(e) << std::endl; }, *e);
+      if(PNG::type(*e) == IDATChunk::type_) {
+        std::vector<Byte> const& d = std::get<IDATChunk>(*e).data();
+        idat.insert(end(idat), begin(d), end(d));
+      }
+    }
+    if(chunks.empty() || PNG::type(*chunks[0]) != IHDRChunk::type_) {
+      return;
+    }
+    // IHDR の大きさは信用できないので、その分を確保せずに固定の領域へ伸長しては捨てて、バイト数だけ数える。
+    size_t const size = rawSize(std::get<IHDRChunk>(*chunks[0]));
+    Deflate::Inflater inflater;
+    inflater.feed(idat.data(), idat.size());
+    std::array<Byte, 64 * 1024> buf;
+    size_t total{0};
+    while(!inflater.finished() && !inflater.failed()) {
+      size_t const n = inflater.inflate(buf.data(), buf.size());
+      total += n;
+      if(n == 0 && inflater.needsInput()) {
+        break;
+      }
     }
+    bool const ok = inflater.finished() && !inflater.failed() && total == size;
+    std::cout << "image data: " << idat.size() << " bytes -> " << total << " bytes" << (ok ? "" : " (broken)") << std::endl;
   }
 }
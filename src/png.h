@@ -1,10 +1,84 @@
+#include <chrono>
 #include <istream>
 #include <memory>
+#include <functional>
+#include <optional>
+#include <string>
+#include "deflate.h"
 #include "image.h"
+#include "sink.h"
 #pragma once
 
 namespace PNG {
   std::unique_ptr<Image> load(std::istream&);
-  std::unique_ptr<Image> exportPNG(std::unique_ptr<Image>&&, std::ostream&);
+  // インターレース(Adam7)画像では、パス(1〜7)を読み終えるたびにその縮小画像を渡す。
+  using PassCallback = std::function<void(int pass, Image const& reduced)>;
+  std::unique_ptr<Image> loadProgressive(std::istream&, PassCallback const&);
+  // ファイルをメモリにマップして、チャンクの中身を写さずに読む。
+  // 8bit RGB で IDAT が1つだけなら、その場所から画素の領域へ Deflate::decompress で一度に伸長する。
+  // それ以外は load と同じく、IDAT の中身をその場所から Inflater に渡して2行ずつ伸長する。
+  std::unique_ptr<Image> loadFile(std::string const& path);
+  // 行ごとのフィルタの選び方。None〜Paeth は全ての行をそのフィルタにする。
+  // MinSum はフィルタ後のバイトの絶対値の和が最小のもの、BruteForce は試しに圧縮して最も小さくなるものを選ぶ。
+  enum class FilterMode { None, Sub, Up, Average, Paeth, MinSum, BruteForce };
+  // parallel なら、行のフィルタと圧縮を区間に分けて全コアで行う。出力はスレッド数によらず同じになる。
+  // そうでなければ Encoder で1行ずつ圧縮しながら書き出す(stream プリセット)。
+  // 圧縮したデータは chunkSize バイトごとに別の IDAT チャンクにする。
+  struct ExportOptions {
+    FilterMode filter{FilterMode::MinSum};
+    bool parallel{true};
+    size_t chunkSize{64 * 1024};
+    Deflate::Level level{Deflate::Level::Default};
+    // 書き出す前に画像を調べて、パレットやグレースケール、低いビット深度で足りればそうする。
+    bool reduce{true};
+    // 0 でなければ、この色数(256 まで)に減色してから書く。元の画像とは変わる。
+    size_t colors{0};
+    // 0 でなければ、この行数ごとに辞書を切って(full flush)圧縮し、その位置を stRP チャンクに書く。
+    // 区間の先頭行は上の行を見ないフィルタにするので、読む時に区間ごとに並列に伸長して戻せる。parallel の時だけ使う。
+    size_t restartRows{0};
+  };
+  // 名前付きの設定(stored, rle, fast, default, max, palette, strips, stream)。stored はフィルタも圧縮もせずほぼ写すだけで、max は最も小さくなるものを探す。
+  // palette は 256 色に減色してパレット画像にする。strips は 64 行ごとに stRP の再開位置を付け、読む側で並列に伸長できるようにする。
+  // stream は Encoder で1行ずつ書き、画像の大きさによらず一定のメモリで書き出す。
+  std::optional<ExportOptions> preset(std::string const& name);
+  std::unique_ptr<Image> exportPNG(std::unique_ptr<Image>&&, ByteSink&);
+
+  // 書き出す時の色の形式。既定は 8bit RGB(カラータイプ 2)。
+  // カラータイプ 3 では palette の色の番号を、0 では灰色の明るさを depth ビットで書く。
+  struct ColorFormat {
+    Byte colorType{2};
+    Byte depth{8};
+    std::vector<Pixel> palette;
+  };
+  // 画像の全ての画素を表せる形式のうち、1画素あたりのビット数が最も少ないものを選ぶ。
+  ColorFormat analyze(Image const&);
+
+  // 画像を1行ずつ受け取り、format に詰めてからフィルタして圧縮しながら書き出す。
+  // format のパレットに無い色や、灰色でない画素を渡してはいけない。
+  // 手元に持つのは1行前の行と書きかけの IDAT チャンクだけなので、画像の大きさによらずメモリは一定。
+  class Encoder {
+  public:
+    Encoder(ByteSink& os, size_t width, size_t height, ExportOptions const& options, ColorFormat const& format = {});
+    ~Encoder();
+    // width 画素の行を上から順に渡す。
+    bool writeRow(Pixel const* row);
+    // writeRow の代わりに、format のパレットの色の番号の行を渡す。format がパレットでなければ false。
+    bool writeIndices(Byte const* row);
+    // 残りの IDAT と IEND を書く。height 行を渡し終えていなければ false。
+    bool finish();
+  private:
+    struct State;
+    std::unique_ptr<State> state;
+  };
+  // 書き終えたら受け取った画像を返す。圧縮や Encoder が失敗したら nullptr を返す(途中まで書いたものは残る)。
+  std::unique_ptr<Image> exportPNG(std::unique_ptr<Image>&&, ByteSink&, ExportOptions const&);
+
+  struct OptimizeOptions {
+    // これを過ぎたら新しい組み合わせを試さず、試し中のものも打ち切る。0 なら制限しない。
+    std::chrono::milliseconds budget{0};
+  };
+  // 色の形式、フィルタ、圧縮の強さの組み合わせを全コアで試して、最も小さくなったものを書く。
+  // 今の最小を超えた試行はその場で打ち切る。時間切れにならなければ、出力はスレッド数や実行順によらず同じになる。
+  bool optimize(Image const&, ByteSink&, OptimizeOptions const&);
   void showInfo(std::istream&);
 }
@@ -1,20 +1,32 @@
+#include <charconv>
 #include <string>
 #include <iostream>
 
 #include "pnm.h"
 
 namespace PNM {
-  std::unique_ptr<Image> exportPNM(std::unique_ptr<Image>&& img, std::ostream& os) {
+  std::unique_ptr<Image> exportPNM(std::unique_ptr<Image>&& img, ByteSink& os) {
     size_t width = img->width();
     size_t height = img->height();
-    std::vector<Pixel> const& ps = img->pixels();
-    os << "P3" << std::endl;
-    os << width << ' ' << height << std::endl;
-    os << 255 << std::endl;
-    for(auto e: ps) {
-      os << static_cast<int>(e.r) << ' ' << static_cast<int>(e.g) << ' ' << static_cast<int>(e.b) << '\n';
+    Pixels const& ps = img->pixels();
+    os.write("P3\n" + std::to_string(width) + ' ' + std::to_string(height) + "\n255\n");
+    // 1画素は高々 "255 255 255\n" の 12 文字なので、行ごとに文字列を作ってまとめて書く。
+    std::vector<char> line(width * 12);
+    for(size_t y{0}; y < height; ++y) {
+      char* p = line.data();
+      char* const last = line.data() + line.size();
+      for(size_t x{0}; x < width; ++x) {
+        Pixel const& e = ps[y * width + x];
+        p = std::to_chars(p, last, e.r).ptr;
+        *p++ = ' ';
+        p = std::to_chars(p, last, e.g).ptr;
+        *p++ = ' ';
+        p = std::to_chars(p, last, e.b).ptr;
+        *p++ = '\n';
+      }
+      os.write(std::string_view{line.data(), static_cast<size_t>(p - line.data())});
     }
-    std::flush(os);
+    os.flush();
     return std::move(img);
   }
 
@@ -28,7 +40,7 @@ namespace PNM {
       int max;
       is >> max;
       if (max != 255) { std::cerr << "max is not 255" << std::endl; }
-      std::vector<Pixel> pixels(width * height);
+      Pixels pixels(width * height);
       for(int i{0}; i < width * height; ++i) {
         int r, g, b;
         is >> r >> g >> b;
@@ -1,9 +1,10 @@
 #include <istream>
 #include <memory>
 #include "image.h"
+#include "sink.h"
 #pragma once
 
 namespace PNM {
   std::unique_ptr<Image> load(std::istream&);
-  std::unique_ptr<Image> exportPNM(std::unique_ptr<Image>&&, std::ostream&);
+  std::unique_ptr<Image> exportPNM(std::unique_ptr<Image>&&, ByteSink&);
 }
@@ -0,0 +1,385 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <utility>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "quantize.h"
+#include "color_table.h"
+#include "parallel.h"
+
+using std::begin;
+using std::end;
+
+namespace Quantize {
+  // 各チャネル 5bit に丸めた色ごとの画素数と、元の色の和。
+  struct Bin {
+    std::array<Byte, 3> cell;
+    uint64_t count;
+    std::array<uint64_t, 3> sum;
+  };
+
+  std::vector<Bin> histogram(Image const& img) {
+    Pixels const& pixels = img.pixels();
+    std::vector<uint32_t> counts(1 << 15);
+    std::vector<std::array<uint64_t, 3>> sums(1 << 15);
+    // 大きな画像は 2^20 画素ほどに間引く。決まった間隔で取るので結果は毎回同じ。
+    size_t const step = std::max<size_t>(1, pixels.size() >> 20);
+    for(size_t i{0}; i < pixels.size(); i += step) {
+      Pixel const p = pixels[i];
+      size_t const key = ((p.r >> 3) << 10) | ((p.g >> 3) << 5) | (p.b >> 3);
+      ++counts[key];
+      sums[key][0] += p.r;
+      sums[key][1] += p.g;
+      sums[key][2] += p.b;
+    }
+    std::vector<Bin> bins;
+    for(size_t key{0}; key < counts.size(); ++key) {
+      if(counts[key] != 0) {
+        std::array<Byte, 3> const cell{static_cast<Byte>(key >> 10), static_cast<Byte>((key >> 5) & 31), static_cast<Byte>(key & 31)};
+        bins.push_back(Bin{cell, counts[key], sums[key]});
+      }
+    }
+    return bins;
+  }
+
+  Pixel average(uint64_t count, std::array<uint64_t, 3> const& sum) {
+    auto mean = [&](size_t c) { return static_cast<Byte>((sum[c] + count / 2) / count); };
+    return Pixel{mean(0), mean(1), mean(2)};
+  }
+
+  Pixel average(Bin const* first, Bin const* last) {
+    uint64_t count{0};
+    std::array<uint64_t, 3> sum{};
+    for(Bin const* b = first; b != last; ++b) {
+      count += b->count;
+      for(size_t c{0}; c < 3; ++c) {
+        sum[c] += b->sum[c];
+      }
+    }
+    return average(count, sum);
+  }
+
+  std::vector<Pixel> medianCut(std::vector<Bin> bins, size_t colors) {
+    struct Box {
+      size_t first, last;
+      uint64_t count;
+      size_t axis;
+      int range;
+    };
+    auto makeBox = [&](size_t first, size_t last) {
+      std::array<int, 3> lo{31, 31, 31}, hi{0, 0, 0};
+      uint64_t count{0};
+      for(size_t i{first}; i < last; ++i) {
+        for(size_t c{0}; c < 3; ++c) {
+          lo[c] = std::min<int>(lo[c], bins[i].cell[c]);
+          hi[c] = std::max<int>(hi[c], bins[i].cell[c]);
+        }
+        count += bins[i].count;
+      }
+      size_t axis{0};
+      for(size_t c{1}; c < 3; ++c) {
+        if(hi[c] - lo[c] > hi[axis] - lo[axis]) {
+          axis = c;
+        }
+      }
+      return Box{first, last, count, axis, hi[axis] - lo[axis]};
+    };
+
+    std::vector<Box> boxes{makeBox(0, bins.size())};
+    while(boxes.size() < colors) {
+      // 割れる箱のうち、画素数と最も長い辺の積が最大のものを割る。
+      auto it = std::max_element(begin(boxes), end(boxes), [](Box const& a, Box const& b) { return a.count * a.range < b.count * b.range; });
+      if(it->range == 0) {
+        break;
+      }
+      Box const box = *it;
+      size_t const axis = box.axis;
+      std::sort(begin(bins) + box.first, begin(bins) + box.last, [axis](Bin const& a, Bin const& b) {
+        return a.cell[axis] != b.cell[axis] ? a.cell[axis] < b.cell[axis] : a.cell < b.cell;
+      });
+      // 画素数が半分になる所で割る。どちらも空にはしない。
+      size_t mid{box.first + 1};
+      for(uint64_t count{bins[box.first].count}; mid + 1 < box.last && count * 2 < box.count; ++mid) {
+        count += bins[mid].count;
+      }
+      *it = makeBox(box.first, mid);
+      boxes.push_back(makeBox(mid, box.last));
+    }
+
+    std::vector<Pixel> palette;
+    for(Box const& box: boxes) {
+      palette.push_back(average(bins.data() + box.first, bins.data() + box.last));
+    }
+    return palette;
+  }
+
+  std::array<Byte, 3> parent(std::array<Byte, 3> const& cell) {
+    return {static_cast<Byte>(cell[0] >> 1), static_cast<Byte>(cell[1] >> 1), static_cast<Byte>(cell[2] >> 1)};
+  }
+
+  std::vector<Pixel> octree(std::vector<Bin> const& bins, size_t colors) {
+    // 5bit の色は深さ 5 の木の葉。深い所から、画素の少ない親の子をまとめて葉を減らす。
+    struct Node {
+      std::array<Byte, 3> cell;
+      int depth;
+      uint64_t count;
+      std::array<uint64_t, 3> sum;
+    };
+    std::vector<Node> leaves;
+    for(Bin const& b: bins) {
+      leaves.push_back(Node{b.cell, 5, b.count, b.sum});
+    }
+    for(int depth{5}; depth > 0 && leaves.size() > colors; --depth) {
+      // この深さの葉を親ごとにまとめる。
+      std::vector<Node> parents;
+      std::vector<size_t> children;
+      std::vector<Node> rest;
+      // 同じ親の子が並ぶように、親の位置で並べる。
+      std::sort(begin(leaves), end(leaves), [](Node const& a, Node const& b) {
+        return a.depth != b.depth ? a.depth > b.depth : std::make_pair(parent(a.cell), a.cell) < std::make_pair(parent(b.cell), b.cell);
+      });
+      for(Node const& n: leaves) {
+        if(n.depth != depth) {
+          rest.push_back(n);
+          continue;
+        }
+        std::array<Byte, 3> const cell = parent(n.cell);
+        if(parents.empty() || parents.back().cell != cell) {
+          parents.push_back(Node{cell, depth - 1, 0, {}});
+          children.push_back(0);
+        }
+        Node& p = parents.back();
+        p.count += n.count;
+        for(size_t c{0}; c < 3; ++c) {
+          p.sum[c] += n.sum[c];
+        }
+        ++children.back();
+      }
+      // 画素の少ない親から、子をまとめて1つの葉にする。
+      std::vector<size_t> order(parents.size());
+      for(size_t i{0}; i < order.size(); ++i) {
+        order[i] = i;
+      }
+      std::stable_sort(begin(order), end(order), [&](size_t a, size_t b) { return parents[a].count < parents[b].count; });
+      size_t count = leaves.size();
+      std::vector<bool> merged(parents.size());
+      for(size_t i: order) {
+        if(count <= colors) {
+          break;
+        }
+        merged[i] = true;
+        count -= children[i] - 1;
+      }
+      std::vector<Node> next = rest;
+      for(Node const& n: leaves) {
+        if(n.depth != depth) {
+          continue;
+        }
+        std::array<Byte, 3> const cell = parent(n.cell);
+        size_t const p = std::lower_bound(begin(parents), end(parents), cell, [](Node const& a, std::array<Byte, 3> const& c) { return a.cell < c; }) - begin(parents);
+        if(!merged[p]) {
+          next.push_back(n);
+        }
+      }
+      for(size_t i{0}; i < parents.size(); ++i) {
+        if(merged[i]) {
+          next.push_back(parents[i]);
+        }
+      }
+      leaves = std::move(next);
+    }
+
+    std::vector<Pixel> palette;
+    for(Node const& n: leaves) {
+      palette.push_back(average(n.count, n.sum));
+    }
+    return palette;
+  }
+
+  // パレットの中で最も近い色(RGB の差の二乗和が最小のもの)を探す。
+  // 4 色ずつまとめて、(r, g) と (b, 0) の差を 16bit の組にして積和命令で二乗和を求める。
+  class Nearest {
+  public:
+    Nearest(std::vector<Pixel> const& palette) : size_{palette.size()} {
+      // 4 の倍数にそろえる。足した色はどの色からも遠いので選ばれない。
+      size_t const padded = (size_ + 3) / 4 * 4;
+      rg_.assign(padded * 2, far);
+      b_.assign(padded * 2, 0);
+      for(size_t i{0}; i < padded; ++i) {
+        if(i < size_) {
+          rg_[2 * i] = palette[i].r;
+          rg_[2 * i + 1] = palette[i].g;
+          b_[2 * i] = palette[i].b;
+        } else {
+          b_[2 * i] = far;
+        }
+      }
+    }
+
+    size_t find(Pixel p) const {
+#if defined(__SSE2__)
+      __m128i const rg = _mm_set1_epi32((p.g << 16) | p.r);
+      __m128i const b = _mm_set1_epi32(p.b);
+      __m128i best = _mm_set1_epi32(std::numeric_limits<int32_t>::max());
+      __m128i bestIndex = _mm_setzero_si128();
+      __m128i index = _mm_setr_epi32(0, 1, 2, 3);
+      __m128i const four = _mm_set1_epi32(4);
+      for(size_t i{0}; i < rg_.size(); i += 8) {
+        __m128i const drg = _mm_sub_epi16(rg, _mm_loadu_si128(reinterpret_cast<__m128i const*>(rg_.data() + i)));
+        __m128i const db = _mm_sub_epi16(b, _mm_loadu_si128(reinterpret_cast<__m128i const*>(b_.data() + i)));
+        __m128i const d = _mm_add_epi32(_mm_madd_epi16(drg, drg), _mm_madd_epi16(db, db));
+        // 同じ距離なら先の色のままにする。
+        __m128i const less = _mm_cmplt_epi32(d, best);
+        best = _mm_or_si128(_mm_and_si128(less, d), _mm_andnot_si128(less, best));
+        bestIndex = _mm_or_si128(_mm_and_si128(less, index), _mm_andnot_si128(less, bestIndex));
+        index = _mm_add_epi32(index, four);
+      }
+      alignas(16) std::array<int32_t, 4> distances;
+      alignas(16) std::array<int32_t, 4> indices;
+      _mm_store_si128(reinterpret_cast<__m128i*>(distances.data()), best);
+      _mm_store_si128(reinterpret_cast<__m128i*>(indices.data()), bestIndex);
+      size_t lane{0};
+      for(size_t l{1}; l < 4; ++l) {
+        if(distances[l] < distances[lane] || (distances[l] == distances[lane] && indices[l] < indices[lane])) {
+          lane = l;
+        }
+      }
+      return indices[lane];
+#else
+      size_t best{0};
+      int bestDistance{std::numeric_limits<int>::max()};
+      for(size_t i{0}; i < size_; ++i) {
+        int const dr = p.r - rg_[2 * i];
+        int const dg = p.g - rg_[2 * i + 1];
+        int const db = p.b - b_[2 * i];
+        int const d = dr * dr + dg * dg + db * db;
+        if(d < bestDistance) {
+          best = i;
+          bestDistance = d;
+        }
+      }
+      return best;
+#endif
+    }
+
+  private:
+    inline static int16_t const far{1000};
+    size_t const size_;
+    std::vector<int16_t> rg_;
+    std::vector<int16_t> b_;
+  };
+
+  std::vector<Pixel> kMeans(std::vector<Bin> const& bins, size_t colors) {
+    std::vector<Pixel> palette = medianCut(bins, colors);
+    // 色の数え方を 5bit に丸めてあるので、数回で十分に落ち着く。
+    for(size_t iteration{0}; iteration < 8; ++iteration) {
+      Nearest const nearest{palette};
+      std::vector<uint64_t> counts(palette.size());
+      std::vector<std::array<uint64_t, 3>> sums(palette.size());
+      for(Bin const& b: bins) {
+        size_t const i = nearest.find(average(b.count, b.sum));
+        counts[i] += b.count;
+        for(size_t c{0}; c < 3; ++c) {
+          sums[i][c] += b.sum[c];
+        }
+      }
+      bool changed{false};
+      for(size_t i{0}; i < palette.size(); ++i) {
+        if(counts[i] == 0) {
+          continue;
+        }
+        Pixel const p = average(counts[i], sums[i]);
+        changed = changed || p.r != palette[i].r || p.g != palette[i].g || p.b != palette[i].b;
+        palette[i] = p;
+      }
+      if(!changed) {
+        break;
+      }
+    }
+    return palette;
+  }
+
+  std::vector<Pixel> palette(Image const& img, Options const& options) {
+    size_t const colors = std::clamp<size_t>(options.colors, 1, 256);
+    ColorTable table;
+    bool fits{true};
+    for(Pixel const& p: img.pixels()) {
+      int const index = table.index(p);
+      if(index < 0 || static_cast<size_t>(index) >= colors) {
+        fits = false;
+        break;
+      }
+    }
+    if(fits) {
+      return table.colors();
+    }
+
+    std::vector<Bin> const bins = histogram(img);
+    switch(options.method) {
+    case Method::Octree:
+      return octree(bins, colors);
+    case Method::KMeans:
+      return kMeans(bins, colors);
+    default:
+      return medianCut(bins, colors);
+    }
+  }
+
+  std::vector<Byte> map(Image const& img, std::vector<Pixel> const& palette) {
+    Pixels const& pixels = img.pixels();
+    std::vector<Byte> indices(pixels.size());
+    if(palette.empty()) {
+      return indices;
+    }
+    auto cellOf = [](Pixel p) { return ((p.r >> 2) << 12) | ((p.g >> 2) << 6) | (p.b >> 2); };
+    // パレットの色を含む格子だけ、画素がパレットにそのままあるかを先に調べる。
+    // パレットに同じ色が2つあると ColorTable の番号がずれるので、その時は調べない。
+    ColorTable const exact{palette};
+    std::vector<bool> hasExact(1 << 18);
+    if(exact.colors().size() == palette.size()) {
+      for(Pixel const& p: palette) {
+        hasExact[cellOf(p)] = true;
+      }
+    }
+    Nearest const nearest{palette};
+    // 各チャネル 6bit の格子ごとに、最も近い色の番号 + 1 を覚えておく(0 はまだ求めていない)。
+    // どのスレッドが求めても同じ値になるので、書き込みが重なっても構わない。
+    std::vector<std::atomic<uint16_t>> grid(1 << 18);
+
+    size_t const width = img.width();
+    size_t const rowsPerStrip{64};
+    size_t const strips = (img.height() + rowsPerStrip - 1) / rowsPerStrip;
+    parallelFor(strips, [&](size_t s) {
+      size_t const first = s * rowsPerStrip * width;
+      size_t const last = std::min(pixels.size(), first + rowsPerStrip * width);
+      for(size_t i{first}; i < last; ++i) {
+        Pixel const p = pixels[i];
+        size_t const c = cellOf(p);
+        int const e = hasExact[c] ? exact.find(p) : -1;
+        if(e >= 0) {
+          indices[i] = e;
+          continue;
+        }
+        std::atomic<uint16_t>& cell = grid[c];
+        uint16_t v = cell.load(std::memory_order_relaxed);
+        if(v == 0) {
+          Pixel const center{static_cast<Byte>((p.r & ~3) | 2), static_cast<Byte>((p.g & ~3) | 2), static_cast<Byte>((p.b & ~3) | 2)};
+          v = nearest.find(center) + 1;
+          cell.store(v, std::memory_order_relaxed);
+        }
+        indices[i] = v - 1;
+      }
+    });
+    return indices;
+  }
+
+  std::unique_ptr<Image> apply(Image const& img, std::vector<Pixel> const& palette) {
+    return std::make_unique<IndexedImage>(img.width(), img.height(), map(img, palette), palette);
+  }
+}
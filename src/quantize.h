@@ -0,0 +1,30 @@
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "byte.h"
+#include "image.h"
+
+#pragma once
+
+// 減色。画像から少ない色数のパレットを作り、各画素をパレットの最も近い色に置き換える。
+namespace Quantize {
+  // MedianCut は色の箱を、画素数が半分ずつになるように最も長い辺で割っていく。
+  // Octree は色の木の葉を、画素の少ない親からまとめていく。
+  // KMeans は MedianCut のパレットから始めて、各色をそこに寄った画素の平均へ動かすことを繰り返す。
+  enum class Method { MedianCut, Octree, KMeans };
+  struct Options {
+    // 1〜256。
+    size_t colors{256};
+    Method method{Method::MedianCut};
+  };
+
+  // 画像の色が colors 色以下なら、その色をそのまま(現れた順に)返す。
+  // そうでなければ、各チャネル 5bit に丸めた色の数を(大きな画像では間引いて)数えてから作る。
+  std::vector<Pixel> palette(Image const&, Options const& = {});
+  // 各画素の、palette の中で最も近い色の番号。palette は 1〜256 色。
+  // 近さは各チャネル 6bit の格子ごとに、その中心の色で求めて覚えておく。パレットにそのままある色は必ずその番号になる。
+  std::vector<Byte> map(Image const&, std::vector<Pixel> const& palette);
+  // 各画素を palette の最も近い色に置き換えた画像。map の結果と palette をそのまま持つ IndexedImage。
+  std::unique_ptr<Image> apply(Image const&, std::vector<Pixel> const& palette);
+}
@@ -22,6 +22,12 @@ struct read_ {
     }
     return t;
   }
+  T operator() (Byte const*& it) {
+    T t;
+    std::copy_n(it, sizeof(T), reinterpret_cast<Byte*>(&t));
+    it += sizeof(T);
+    return t;
+  }
 };
 template<typename T>
 struct read_<std::vector<T>> {
@@ -36,6 +42,12 @@ struct read_<std::vector<T>> {
     std::advance(it, n * sizeof(T));
     return v;
   }
+  std::vector<T> operator() (Byte const*& it, size_t n) {
+    std::vector<T> v(n);
+    std::copy_n(it, n * sizeof(T), reinterpret_cast<Byte*>(v.data()));
+    it += n * sizeof(T);
+    return v;
+  }
 };
 template<typename T, size_t N>
 struct read_<std::array<T, N>> {
@@ -50,6 +62,12 @@ struct read_<std::array<T, N>> {
     std::advance(it, N * sizeof(T));
     return arr;
   }
+  std::array<T, N> operator() (Byte const*& it) {
+    std::array<T, N> arr;
+    std::copy_n(it, N * sizeof(T), reinterpret_cast<Byte*>(arr.data()));
+    it += N * sizeof(T);
+    return arr;
+  }
 };
 }
 
@@ -0,0 +1,74 @@
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "sink.h"
+
+void ByteSink::write(Byte const* data, size_t size) {
+  if(buf_.size() + size <= buf_.capacity()) {
+    buf_.insert(end(buf_), data, data + size);
+    return;
+  }
+  if(good_) {
+    good_ = emit(buf_, std::span<Byte const>{data, size});
+  }
+  buf_.clear();
+}
+
+bool ByteSink::flush() {
+  if(good_ && !buf_.empty()) {
+    good_ = emit(buf_, {});
+  }
+  buf_.clear();
+  return good_;
+}
+
+bool FdSink::emit(std::span<Byte const> first, std::span<Byte const> second) {
+  if(fd_ < 0) {
+    return false;
+  }
+  iovec iov[2] = {
+    {const_cast<Byte*>(first.data()), first.size()},
+    {const_cast<Byte*>(second.data()), second.size()},
+  };
+  iovec* v = iov;
+  int count{2};
+  while(count > 0) {
+    ssize_t n = writev(fd_, v, count);
+    if(n < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    // 途中までしか書けなかったら、書けた分を飛ばして続きを書く。
+    for(; count > 0 && static_cast<size_t>(n) >= v->iov_len; --count, ++v) {
+      n -= v->iov_len;
+    }
+    if(count > 0) {
+      v->iov_base = static_cast<Byte*>(v->iov_base) + n;
+      v->iov_len -= n;
+    }
+  }
+  return true;
+}
+
+FileSink::FileSink(std::string const& path) : FdSink{open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)} {
+  if(fd_ < 0) {
+    fail();
+  }
+}
+
+FileSink::~FileSink() {
+  flush();
+  if(fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+bool MemorySink::emit(std::span<Byte const> first, std::span<Byte const> second) {
+  data_.insert(end(data_), begin(first), end(first));
+  data_.insert(end(data_), begin(second), end(second));
+  return true;
+}
@@ -0,0 +1,69 @@
+#include <cstddef>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "byte.h"
+
+#pragma once
+
+// 書き出し先。小さな書き込みはバッファにためてまとめて書き、
+// バッファより大きな書き込みはためてある分と一緒に写さずに渡す(ファイルなら writev 1回になる)。
+// 書けなかった時は good() が false になり、それ以降の書き込みは捨てる。
+class ByteSink {
+public:
+  virtual ~ByteSink() = default;
+  ByteSink(ByteSink const&) = delete;
+  ByteSink& operator=(ByteSink const&) = delete;
+
+  void put(Byte b) {
+    if(buf_.size() == buf_.capacity()) {
+      flush();
+    }
+    buf_.push_back(b);
+  }
+  void write(Byte const* data, size_t size);
+  void write(std::string_view s) { write(reinterpret_cast<Byte const*>(s.data()), s.size()); }
+  // ためてある分を書き出す。
+  bool flush();
+  bool good() const { return good_; }
+
+protected:
+  ByteSink(size_t capacity = 64 * 1024) : good_{true} { buf_.reserve(capacity); }
+  void fail() { good_ = false; }
+  // first, second の順に全て書く。
+  virtual bool emit(std::span<Byte const> first, std::span<Byte const> second) = 0;
+
+private:
+  std::vector<Byte> buf_;
+  bool good_;
+};
+
+// ファイルディスクリプタに書く。標準出力(パイプ)はこれで fd 1 に書く。
+class FdSink : public ByteSink {
+public:
+  FdSink(int fd) : fd_{fd} {}
+  ~FdSink() override { flush(); }
+protected:
+  bool emit(std::span<Byte const> first, std::span<Byte const> second) override;
+  int const fd_;
+};
+
+// ファイルを作って(あれば切り詰めて)書く。開けなかったら good() が false。
+class FileSink : public FdSink {
+public:
+  FileSink(std::string const& path);
+  ~FileSink() override;
+};
+
+// メモリ上に書く。
+class MemorySink : public ByteSink {
+public:
+  ~MemorySink() override { flush(); }
+  std::vector<Byte> const& data() { flush(); return data_; }
+protected:
+  bool emit(std::span<Byte const> first, std::span<Byte const> second) override;
+private:
+  std::vector<Byte> data_;
+};